@@ -0,0 +1,121 @@
+#include "aggregate.h"
+
+#if defined(__GNUC__)&&(defined(__x86_64__)||defined(__i386__))
+#define AGGREGATE_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static double sumNumbersScalar(const double *numbers,size_t n) noexcept {
+	double res=0;
+	for(size_t i=0;i<n;i++)res+=numbers[i];
+	return res;
+}
+
+static size_t countNonEmptyScalar(const valuetype_t *types,size_t n) noexcept {
+	size_t count=0;
+	for(size_t i=0;i<n;i++)count+=types[i]!=VT_EMPTY;
+	return count;
+}
+
+#ifdef AGGREGATE_X86
+
+__attribute__((target("sse2")))
+static double sumNumbersSSE2(const double *numbers,size_t n) noexcept {
+	__m128d acc0=_mm_setzero_pd(),acc1=_mm_setzero_pd();
+	size_t i=0;
+	for(;i+4<=n;i+=4){
+		acc0=_mm_add_pd(acc0,_mm_loadu_pd(numbers+i));
+		acc1=_mm_add_pd(acc1,_mm_loadu_pd(numbers+i+2));
+	}
+	double buf[2];
+	_mm_storeu_pd(buf,_mm_add_pd(acc0,acc1));
+	return buf[0]+buf[1]+sumNumbersScalar(numbers+i,n-i);
+}
+
+__attribute__((target("sse2")))
+static size_t countNonEmptySSE2(const valuetype_t *types,size_t n) noexcept {
+	const __m128i zero=_mm_setzero_si128();
+	size_t count=0,i=0;
+	for(;i+16<=n;i+=16){
+		__m128i v=_mm_loadu_si128((const __m128i*)(types+i));
+		unsigned int emptymask=_mm_movemask_epi8(_mm_cmpeq_epi8(v,zero));
+		count+=16-__builtin_popcount(emptymask);
+	}
+	return count+countNonEmptyScalar(types+i,n-i);
+}
+
+__attribute__((target("avx2")))
+static double sumNumbersAVX2(const double *numbers,size_t n) noexcept {
+	__m256d acc0=_mm256_setzero_pd(),acc1=_mm256_setzero_pd();
+	__m256d acc2=_mm256_setzero_pd(),acc3=_mm256_setzero_pd();
+	size_t i=0;
+	for(;i+16<=n;i+=16){
+		acc0=_mm256_add_pd(acc0,_mm256_loadu_pd(numbers+i));
+		acc1=_mm256_add_pd(acc1,_mm256_loadu_pd(numbers+i+4));
+		acc2=_mm256_add_pd(acc2,_mm256_loadu_pd(numbers+i+8));
+		acc3=_mm256_add_pd(acc3,_mm256_loadu_pd(numbers+i+12));
+	}
+	__m256d acc=_mm256_add_pd(_mm256_add_pd(acc0,acc1),_mm256_add_pd(acc2,acc3));
+	double buf[4];
+	_mm256_storeu_pd(buf,acc);
+	return (buf[0]+buf[1])+(buf[2]+buf[3])+sumNumbersScalar(numbers+i,n-i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t countNonEmptyAVX2(const valuetype_t *types,size_t n) noexcept {
+	const __m256i zero=_mm256_setzero_si256();
+	size_t count=0,i=0;
+	for(;i+32<=n;i+=32){
+		__m256i v=_mm256_loadu_si256((const __m256i*)(types+i));
+		unsigned int emptymask=_mm256_movemask_epi8(_mm256_cmpeq_epi8(v,zero));
+		count+=32-__builtin_popcount(emptymask);
+	}
+	return count+countNonEmptyScalar(types+i,n-i);
+}
+
+#endif
+
+//the kernels to use, chosen once on first use
+struct AggregateKernels{
+	double (*sum)(const double*,size_t) noexcept;
+	size_t (*count)(const valuetype_t*,size_t) noexcept;
+
+	AggregateKernels() noexcept {
+#ifdef AGGREGATE_X86
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2")&&__builtin_cpu_supports("popcnt")){
+			sum=sumNumbersAVX2;
+			count=countNonEmptyAVX2;
+			return;
+		}
+		if(__builtin_cpu_supports("sse2")){
+			sum=sumNumbersSSE2;
+			count=countNonEmptySSE2;
+			return;
+		}
+#endif
+		sum=sumNumbersScalar;
+		count=countNonEmptyScalar;
+	}
+};
+
+static const AggregateKernels& kernels() noexcept {
+	static const AggregateKernels k;
+	return k;
+}
+
+double sumNumbers(const double *numbers,size_t n) noexcept {
+	return kernels().sum(numbers,n);
+}
+
+size_t countNonEmpty(const valuetype_t *types,size_t n) noexcept {
+	return kernels().count(types,n);
+}
+
+size_t countInexact(const double *numbers,size_t n) noexcept {
+	size_t count=0;
+	for(size_t i=0;i<n;i++)count+=!isExactInteger(numbers[i]);
+	return count;
+}
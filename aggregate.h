@@ -0,0 +1,31 @@
+#pragma once
+
+#include "celltile.h"
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+/*
+Aggregation kernels over the value lanes of CellTile's, as handed out by
+CellArray::spans(). These are vectorised with SSE2 or AVX2 where available;
+the variant is chosen at runtime based on the processor, with a scalar
+fallback for other platforms.
+*/
+
+//sum of n numbers
+double sumNumbers(const double *numbers,size_t n) noexcept;
+
+//number of the n types that are not VT_EMPTY
+size_t countNonEmpty(const valuetype_t *types,size_t n) noexcept;
+
+//Whether a number is an integer of magnitude at most 2^32. Sums of up to
+//MAX_EXACT_TERMS of those are exact, whatever the order of the additions,
+//so they can be kept up to date by adding differences.
+static const size_t MAX_EXACT_TERMS=1<<20;
+inline bool isExactInteger(double number) noexcept {
+	return number>=-4294967296.0&&number<=4294967296.0&&number==(double)(int64_t)number;
+}
+
+//number of the n numbers that are not exact integers
+size_t countInexact(const double *numbers,size_t n) noexcept;
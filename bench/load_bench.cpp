@@ -0,0 +1,61 @@
+#include "../spreadsheet.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+
+using namespace std;
+
+/*
+Measures the load throughput of a text-heavy sheet: 500k cells in 10 columns,
+80% of them text and the rest ints and doubles, which is the case where
+classifying edit strings as numbers dominates loading.
+Usage: load_bench [runs]
+*/
+
+int main(int argc,char **argv){
+	const int runs=argc>1?atoi(argv[1]):5;
+	const unsigned int ROWS=50000,COLUMNS=10;
+	const string fname="/tmp/load_bench."+to_string(getpid())+".sheet";
+
+	{
+		Spreadsheet sheet;
+		sheet.beginTransaction();
+		unsigned int seed=12345;
+		for(unsigned int row=0;row<ROWS;row++){
+			for(unsigned int column=0;column<COLUMNS;column++){
+				seed=seed*1103515245+12345;
+				const unsigned int r=(seed>>8)%100;
+				string value;
+				if(r<80)value="item "+to_string(seed%100000)+" of lot "+to_string(row);
+				else if(r<90)value=to_string((int)(seed%2000000)-1000000);
+				else value=to_string(seed%100000)+"."+to_string(seed%97);
+				sheet.changeCellValue(CellAddress(row,column),value);
+			}
+		}
+		sheet.commitTransaction();
+		if(!sheet.saveToDisk(fname)){
+			fprintf(stderr,"Could not write %s\n",fname.c_str());
+			return 1;
+		}
+	}
+
+	double best=0;
+	for(int i=0;i<runs;i++){
+		Spreadsheet sheet;
+		const auto start=chrono::steady_clock::now();
+		if(!sheet.loadFromDisk(fname)){
+			fprintf(stderr,"Could not load %s\n",fname.c_str());
+			unlink(fname.c_str());
+			return 1;
+		}
+		const double ms=chrono::duration<double,milli>(chrono::steady_clock::now()-start).count();
+		if(i==0||ms<best)best=ms;
+		printf("run %d: %.0f ms\n",i+1,ms);
+	}
+	unlink(fname.c_str());
+	printf("best of %d: %.0f ms for %u cells, %.2f M cells/s\n",
+	       runs,best,ROWS*COLUMNS,ROWS*COLUMNS/best/1000);
+	return 0;
+}
@@ -2,7 +2,11 @@
 #include "spreadsheet.h"
 #include "cellvalue.h"
 #include "celladdress.h"
+#include "conversion.h"
+#include "numberformat.h"
+#include "stringpool.h"
 #include "util.h"
+#include "slab.h"
 #include <vector>
 #include <string>
 #include <utility>
@@ -10,121 +14,168 @@
 using namespace std;
 
 
-Cell::Cell(CellValue *value,CellAddress address) noexcept
-	:value(value),address(address){}
+Cell::Cell() noexcept
+	:kind(CK_EMPTY),doubleval(0){}
 
-Cell::Cell(CellAddress address) noexcept
-	:value(new CellValueBasic<string>("")),address(address){}
-
-Cell::Cell(string editString,CellAddress address) noexcept
-	:value(nullptr),address(address){
-	setEditString(editString);
+void Cell::assign(string s,CellAddress addr,Slab &slab,StringPool &pool) noexcept {
+	kind=CK_EMPTY;
+	if(s.empty())return;
+	int i;
+	double d;
+	switch(parseNumber(s,i,d)){
+		case NK_INT: intval=i; kind=CK_INT; return;
+		case NK_DOUBLE: doubleval=d; kind=CK_DOUBLE; return;
+		case NK_NONE: break;
+	}
+	if(s[0]=='='){
+		Either<string,CellValueFormula*> mcv=CellValueFormula::parseAndCreateFormula(s,addr,slab);
+		if(mcv.isLeft()){
+			error.display=pool.add("ERR:Invalid formula: "+mcv.fromLeft());
+			error.edit=pool.add(s);
+			kind=CK_ERROR;
+		} else {
+			formula=mcv.fromRight();
+			kind=CK_FORMULA;
+		}
+		return;
+	}
+	text=pool.add(s);
+	kind=CK_STRING;
 }
 
-Cell::~Cell() noexcept {}
-
-Cell Cell::makeErrorCell(string errString,string editString,CellAddress address) noexcept {
-	return Cell(new CellValueError(errString,editString),address);
+void Cell::setError(string_view errString,CellAddress addr,Slab &slab,StringPool &pool) noexcept {
+	const uint32_t display=pool.add("ERR:"+string(errString));
+	const uint32_t edit=pool.add(getEditString(addr,pool));
+	clear(slab,pool);
+	error.display=display;
+	error.edit=edit;
+	kind=CK_ERROR;
 }
 
-void Cell::setError(string errString) noexcept {
-	CellValue *newvalue;
-	if(value){
-		newvalue=new CellValueError(errString,value->getEditString());
-		delete value;
-	} else {
-		newvalue=new CellValueError(errString,"");
+void Cell::clear(Slab &slab,StringPool &pool) noexcept {
+	switch(kind){
+		case CK_STRING: pool.release(text); break;
+		case CK_FORMULA: slab.destroy(formula); break;
+		case CK_ERROR: pool.release(error.display); pool.release(error.edit); break;
+		default: break;
 	}
-	value=newvalue;
+	kind=CK_EMPTY;
 }
 
-const set<CellAddress>& Cell::getReverseDependencies() const noexcept {
-	return revdeps;
+bool Cell::isEmpty() const noexcept {
+	return kind==CK_EMPTY;
 }
 
-bool Cell::addReverseDependency(CellAddress addr) noexcept {
-	return revdeps.insert(addr).second;
+void Cell::swapValue(Cell &other) noexcept {
+	swap(*this,other);
 }
 
-void Cell::addReverseDependencies(const set<CellAddress> &addrs) noexcept {
-	for(const CellAddress &addr : addrs){
-		revdeps.insert(addr);
-	}
+void Cell::setEditString(string s,CellAddress addr,Slab &slab,StringPool &pool) noexcept {
+	clear(slab,pool);
+	assign(move(s),addr,slab,pool);
 }
 
-bool Cell::removeReverseDependency(CellAddress addr) noexcept {
-	auto it=revdeps.find(addr);
-	if(it==revdeps.end())return false;
-	revdeps.erase(it);
-	return true;
+string_view Cell::getDisplayString(const StringPool &pool,char *buf) const noexcept {
+	switch(kind){
+		case CK_EMPTY: return string_view();
+		case CK_INT: return string_view(buf,formatNumber(intval,buf));
+		case CK_DOUBLE: return string_view(buf,formatNumber(doubleval,buf));
+		case CK_STRING: return pool.get(text);
+		case CK_FORMULA: return formula->getDisplayString(buf);
+		case CK_ERROR: return pool.get(error.display);
+	}
+	return string_view();
 }
 
-void Cell::setEditString(string s) noexcept {
-	if(value)delete value;
-	value=CellValue::cellValueFromString(s);
+valuetype_t Cell::getValue(double &number,string_view &str,const StringPool &pool) const noexcept {
+	switch(kind){
+		case CK_EMPTY: return VT_EMPTY;
+		case CK_INT: number=intval; return VT_NUMBER;
+		case CK_DOUBLE: number=doubleval; return VT_NUMBER;
+		case CK_STRING: str=pool.get(text); return VT_STRING;
+		case CK_FORMULA: return formula->getValue(number,str);
+		case CK_ERROR: return VT_ERROR;
+	}
+	return VT_EMPTY;
 }
 
-string Cell::getDisplayString() const noexcept {
-	return value->getDisplayString();
+string Cell::getEditString(CellAddress addr,const StringPool &pool) const noexcept {
+	char buf[NUMBER_BUFSIZE];
+	switch(kind){
+		case CK_FORMULA: return formula->getEditString(addr);
+		case CK_ERROR: return string(pool.get(error.edit));
+		default: return string(getDisplayString(pool,buf));
+	}
 }
 
-string Cell::getEditString() const noexcept {
-	return value->getEditString();
+bool Cell::isErrorValue() const noexcept {
+	return kind==CK_ERROR;
 }
 
-bool Cell::isErrorValue() const noexcept {
-	return (bool)dynamic_cast<CellValueError*>(value);
+bool Cell::getTextHandle(uint32_t &handle) const noexcept {
+	if(kind!=CK_STRING)return false;
+	handle=text;
+	return true;
 }
 
-void Cell::update(const CellArray &cells) noexcept {
-	if(value->update(cells)){
-		CellValue *newvalue=CellValue::cellValueFromString(value->getEditString());
-		delete value;
-		value=newvalue;
-		value->update(cells);
+void Cell::update(const CellArray &cells,CellAddress addr,const ChangeList *changes) noexcept {
+	if(kind==CK_FORMULA){
+		formula->update(cells,addr,changes);
+	} else if(kind==CK_ERROR){
+		//the error may be resolved, so regenerate the value from its edit string
+		Slab &slab=cells.valueSlab();
+		StringPool &pool=cells.stringPool();
+		string s(pool.get(error.edit));
+		clear(slab,pool);
+		assign(move(s),addr,slab,pool);
+		if(kind==CK_FORMULA)formula->update(cells,addr,nullptr);
 	}
 }
 
-vector<CellAddress> Cell::getDependencies() const noexcept {
-	return value->getDependencies();
+Dependencies Cell::getDependencies(CellAddress addr,const StringPool &pool) const noexcept {
+	if(kind==CK_FORMULA)return formula->getDependencies(addr);
+	if(kind!=CK_ERROR)return Dependencies();
+	//only a valid formula has dependencies, so don't bother making a value
+	const string_view edit=pool.get(error.edit);
+	if(edit.empty()||edit[0]!='=')return Dependencies();
+	Either<string,shared_ptr<const Formula>> mparsed=Formula::parse(string(edit.substr(1)),addr);
+	if(mparsed.isLeft())return Dependencies();
+	return mparsed.fromRight()->getDependencies(addr);
 }
 
 /*
 Serialisation format:
-First the number of reverse dependencies, then a list of them.
+First the number of reverse dependencies, then a list of them; these are
+always written as an empty list and skipped when reading, since the sheet
+rebuilds them from the formulas.
 Then a byte indicating whether this is an error cell, which has two strings to
 store instead of one, followed by the string(s) of the cell value.
 */
-void Cell::serialise(ostream &os) const {
-	writeUInt32LE(os,revdeps.size());
-	for(const CellAddress &revdepaddr : revdeps){
-		revdepaddr.serialise(os);
-	}
-	if(CellValueError *cve=dynamic_cast<CellValueError*>(value)){
+void Cell::serialise(ostream &os,CellAddress addr,const StringPool &pool) const {
+	writeUInt32LE(os,0);
+	if(kind==CK_ERROR){
 		os<<(unsigned char)1;
-		const string &s=cve->getErrorString();
+		const string_view s=pool.get(error.display).substr(4); //strip "ERR:"
 		writeUInt32LE(os,s.size());
 		os<<s;
 	} else {
 		os<<(unsigned char)0;
 	}
-	const string &s=value->getEditString();
+	const string &s=getEditString(addr,pool);
 	writeUInt32LE(os,s.size());
 	os<<s;
 }
 
-void Cell::deserialise(istream &in){
+void Cell::deserialise(istream &in,CellAddress addr,Slab &slab,StringPool &pool){
 	unsigned int nrevdeps=readUInt32LE(in);
 	if(in.fail())return; //random allocation prevention
-	revdeps.clear();
 	unsigned int i;
 	for(i=0;i<nrevdeps;i++){
-		CellAddress ca=CellAddress::deserialise(in);
-		revdeps.insert(ca);
+		CellAddress::deserialise(in);
 	}
 	unsigned char iserror;
 	in>>iserror;
-	if(value)delete value;
+	clear(slab,pool);
 	if(iserror){
 		string err,edit;
 		unsigned int errlen,editlen;
@@ -140,13 +191,15 @@ void Cell::deserialise(istream &in){
 		in.read(&edit.front(),editlen);
 		if(in.fail())return;
 
-		value=new CellValueError(err,edit);
+		error.display=pool.add("ERR:"+err);
+		error.edit=pool.add(edit);
+		kind=CK_ERROR;
 	} else {
 		unsigned int len=readUInt32LE(in);
 		if(in.fail())return;
 		string s;
 		s.resize(len);
 		in.read(&s.front(),len);
-		value=CellValue::cellValueFromString(s);
+		assign(move(s),addr,slab,pool);
 	}
 }
@@ -2,66 +2,110 @@
 
 #include "celladdress.h"
 #include "maybe.h"
-#include "spreadsheet.h"
 #include <iostream>
 #include <vector>
 #include <string>
-#include <set>
+#include <string_view>
+#include <cstdint>
 #include <utility>
 
 using namespace std;
 
 /*
-A cell in the spreadsheet; contains a CellValue (an instance from an abstract
-base class) to keep its value. Supports management of reverse dependencies, and
-serialisation.
+A cell in the spreadsheet; a tagged value of 16 bytes. Numbers are stored
+inline, so that an empty or numeric cell costs no allocation and reading it
+no indirection. Strings, including both strings of an error value, are handles
+in the StringPool of the CellArray, and formulas are allocated in its Slab.
+The cell doesn't know of either: the functions that replace the value get them,
+and the owner of the cell must clear() it before it is destroyed. Supports
+serialisation. The reverse dependencies of cells are kept by the Spreadsheet,
+in a DependencyGraph.
+A cell doesn't know its own address either; the functions that need it, since
+formulas are stored relative to their cell, get it from the owner.
 */
 
 class CellArray;
-
-class CellValue;
+struct ChangeList;
+
+class CellValueFormula;
+class Slab;
+class StringPool;
+
+//the type of the evaluated value of a cell
+enum valuetype_t : unsigned char {
+	VT_EMPTY, //empty display string
+	VT_NUMBER,
+	VT_STRING,
+	VT_ERROR
+};
 
 class Cell{
-	CellValue *value;
-	set<CellAddress> revdeps; //reverse dependencies: cells that depend on this one
-	const CellAddress address; //address of this cell in sheet
-
-	Cell(CellValue *value,CellAddress address) noexcept;
+	enum kind_t : unsigned char {
+		CK_EMPTY,
+		CK_INT,
+		CK_DOUBLE,
+		CK_STRING,
+		CK_FORMULA,
+		CK_ERROR
+	};
+
+	kind_t kind;
+	union{
+		int intval;
+		double doubleval;
+		uint32_t text;
+		CellValueFormula *formula;
+		struct{
+			uint32_t display; //the error string, prefixed with "ERR:"
+			uint32_t edit;
+		} error;
+	};
+
+	//sets the value from an edit string, after the old value was released
+	void assign(string s,CellAddress addr,Slab &slab,StringPool &pool) noexcept;
 
 public:
-	Cell(CellAddress address) noexcept;
-	Cell(string editString,CellAddress address) noexcept; //doesn't update() yet!
-	~Cell() noexcept;
+	Cell() noexcept; //makes an empty cell
 
-	static Cell makeErrorCell(string errString,string editString,CellAddress address) noexcept;
+	void setError(string_view errString,CellAddress addr,Slab &slab,StringPool &pool) noexcept;
 
-	void setError(string errString) noexcept;
+	//makes this an empty cell
+	void clear(Slab &slab,StringPool &pool) noexcept;
 
-	//returns set of cells dependent on this cell
-	const set<CellAddress>& getReverseDependencies() const noexcept;
+	//returns whether the cell has no value
+	bool isEmpty() const noexcept;
 
-	//false indicates already present
-	bool addReverseDependency(CellAddress addr) noexcept;
-	//bulk version of addReverseDependency
-	void addReverseDependencies(const set<CellAddress> &addrs) noexcept;
-	//false indicates not present
-	bool removeReverseDependency(CellAddress addr) noexcept;
+	//exchanges the values of the two cells
+	void swapValue(Cell &other) noexcept;
 
 	//doesn't update the cell's display string, do that with update()
-	void setEditString(string s) noexcept;
+	void setEditString(string s,CellAddress addr,Slab &slab,StringPool &pool) noexcept;
 
-	string getDisplayString() const noexcept;
-	string getEditString() const noexcept;
+	//numbers are formatted into buf, of NUMBER_BUFSIZE characters; the result
+	//is valid until the cell or buf changes
+	string_view getDisplayString(const StringPool &pool,char *buf) const noexcept;
+	string getEditString(CellAddress addr,const StringPool &pool) const noexcept;
+
+	//the evaluated value of the cell, without formatting it: sets number for
+	//VT_NUMBER, and str for VT_STRING (valid until the cell changes)
+	valuetype_t getValue(double &number,string_view &str,const StringPool &pool) const noexcept;
 
 	//returns whether the cell contains an error value
 	bool isErrorValue() const noexcept;
 
-	//updates the cell, using possibly changed values of its dependencies
-	void update(const CellArray &cells) noexcept;
+	//for a text cell, sets handle to that of its string in the StringPool and
+	//returns true, so that the string can be shared without looking it up
+	bool getTextHandle(uint32_t &handle) const noexcept;
+
+	//updates the cell, using possibly changed values of its dependencies;
+	//changes may be nullptr if those aren't known
+	void update(const CellArray &cells,CellAddress addr,const ChangeList *changes) noexcept;
 
 	//returns list of dependencies for this cell
-	vector<CellAddress> getDependencies() const noexcept;
+	Dependencies getDependencies(CellAddress addr,const StringPool &pool) const noexcept;
 
-	void serialise(ostream &os) const; //serialises the cell to the stream
-	void deserialise(istream &in); //deserialises the cell from the stream
+	//serialises the cell to the stream
+	void serialise(ostream &os,CellAddress addr,const StringPool &pool) const;
+	//deserialises the cell from the stream
+	void deserialise(istream &in,CellAddress addr,Slab &slab,StringPool &pool);
 };
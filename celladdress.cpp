@@ -94,3 +94,25 @@ string CellRange::toRepresentation() const noexcept {
 unsigned int CellRange::size() const noexcept {
 	return (to.column-from.column+1)*(to.row-from.row+1);
 }
+
+bool CellRange::contains(CellAddress addr) const noexcept {
+	return addr.row>=from.row&&addr.row<=to.row&&
+	       addr.column>=from.column&&addr.column<=to.column;
+}
+
+
+bool operator==(const CellRange &a,const CellRange &b) noexcept {
+	return a.from==b.from&&a.to==b.to;
+}
+
+
+
+bool Dependencies::contains(CellAddress addr) const noexcept {
+	for(const CellAddress &cell : cells){
+		if(cell==addr)return true;
+	}
+	for(const CellRange &range : ranges){
+		if(range.contains(addr))return true;
+	}
+	return false;
+}
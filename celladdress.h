@@ -2,6 +2,7 @@
 
 #include "maybe.h"
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -16,6 +17,10 @@ CellRange is just a pair of CellAddresses, again with some special methods.
 In the data, no care is taken to ensure that e.g. the x-coordinate of the first
 address is <= that of the second; that is, however, taken care of by the
 representation conversion functions and CellArray::range().
+
+Dependencies is the list of cells that a cell value depends on. Ranges are kept
+as ranges instead of being expanded into their cells, so that the size of a
+dependency list doesn't depend on the area it covers.
 */
 
 class CellAddress{
@@ -71,6 +76,19 @@ public:
 
 	//number of cells spanned
 	unsigned int size() const noexcept;
+
+	//whether addr is inside this range
+	bool contains(CellAddress addr) const noexcept;
 };
 
 bool operator==(const CellRange &a,const CellRange &b) noexcept;
+
+
+class Dependencies{
+public:
+	vector<CellAddress> cells;
+	vector<CellRange> ranges;
+
+	//whether addr is one of the cells, or inside one of the ranges
+	bool contains(CellAddress addr) const noexcept;
+};
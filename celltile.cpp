@@ -0,0 +1,88 @@
+#include "celltile.h"
+#include <cstring>
+
+using namespace std;
+
+CellTile::CellTile(CellAddress origin,Slab &values,StringPool &pool)
+		:cells(CELLS),origin(origin),values(values),pool(pool){
+	for(unsigned int i=0;i<CELLS;i++){
+		types[i]=VT_EMPTY;
+		numbers[i]=0;
+		levels[i]=0;
+	}
+	maxlevel=0;
+	for(unsigned int x=0;x<CELLS/64;x++)stale[x]=dirty[x]=0;
+	nstale=0;
+}
+
+CellTile::~CellTile() noexcept {
+	for(Cell &cell : cells)cell.clear(values,pool);
+	for(unsigned int i=0;i<CELLS;i++){
+		if(types[i]==VT_STRING)pool.release(strings[i]);
+	}
+}
+
+unsigned int CellTile::index(CellAddress addr) noexcept {
+	return ((addr.column&COLUMNMASK)<<ROWSHIFT)|(addr.row&ROWMASK);
+}
+
+CellAddress CellTile::address(unsigned int idx) const noexcept {
+	return CellAddress(origin.row+(idx&ROWMASK),origin.column+(idx>>ROWSHIFT));
+}
+
+Cell& CellTile::operator[](CellAddress addr) noexcept {
+	return cells[index(addr)];
+}
+
+const Cell& CellTile::operator[](CellAddress addr) const noexcept {
+	return cells[index(addr)];
+}
+
+bool CellTile::publish(unsigned int idx){
+	const valuetype_t oldtype=types[idx];
+	const double oldnumber=numbers[idx];
+	double number=0;
+	string_view str;
+	valuetype_t type=cells[idx].getValue(number,str,pool);
+	if(type==VT_STRING&&str.empty())type=VT_EMPTY;
+	if(oldtype==VT_STRING){
+		if(type==VT_STRING&&str==pool.get(strings[idx]))return false;
+		pool.release(strings[idx]);
+	}
+	types[idx]=type;
+	numbers[idx]=type==VT_NUMBER?number:0;
+	if(type==VT_STRING){
+		uint32_t handle;
+		if(cells[idx].getTextHandle(handle)){
+			pool.retain(handle);
+			strings[idx]=handle;
+		} else strings[idx]=pool.add(str);
+		return true;
+	}
+	//compare bitwise, so that NaN's are equal and 0 and -0 are not
+	if(type==VT_NUMBER)return oldtype!=VT_NUMBER||memcmp(&oldnumber,&number,sizeof(double))!=0;
+	return oldtype!=type;
+}
+
+bool CellTile::clearOutside(unsigned int w,unsigned int h) noexcept {
+	bool anyinside=false;
+	for(unsigned int i=0;i<CELLS;i++){
+		const CellAddress addr=address(i);
+		if(addr.row<h&&addr.column<w){
+			anyinside=true;
+			continue;
+		}
+		cells[i].clear(values,pool);
+		if(types[i]==VT_STRING)pool.release(strings[i]);
+		types[i]=VT_EMPTY;
+		numbers[i]=0;
+		levels[i]=0;
+		const uint64_t bit=(uint64_t)1<<(i&63);
+		if(stale[i>>6]&bit){
+			stale[i>>6]&=~bit;
+			dirty[i>>6]&=~bit;
+			nstale--;
+		}
+	}
+	return anyinside;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "celladdress.h"
+#include "cell.h"
+#include "stringpool.h"
+#include "slab.h"
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+/*
+A CellTile is a fixed-size block of cells, the unit of allocation in
+CellArray. Tiles are only created once one of their cells is written to, so
+large empty regions of a sheet cost no memory at all. They are tall and
+narrow, since sheets mostly grow downwards: a single long column of data
+then wastes little space.
+
+Next to the Cell objects, a tile keeps the evaluated values of its cells in
+struct-of-arrays form: a type per cell, and a number lane and a string handle
+lane. The formula evaluator reads these lanes instead of parsing the display
+strings of cells. For cells that aren't numbers, the number lane holds 0, so
+that a run of it can be summed directly.
+
+The tile also keeps the topological level of each of its cells in the
+dependency graph (see Spreadsheet), and an upper bound of those levels for the
+whole tile, so that the maximum level in a range can be found without visiting
+every cell in it. Likewise, the cells whose value may be out of date (in the
+lazy and manual calculation modes of Spreadsheet) are kept as a bit per cell,
+with a count for the whole tile, and those that certainly are as another.
+
+Cells within a tile are stored column-major, so that a run of rows in a single
+column is contiguous in memory.
+*/
+
+class CellTile{
+	friend class CellArray;
+	friend class CellArraySpanIt;
+
+public:
+	static const unsigned int ROWSHIFT=8;
+	static const unsigned int ROWS=1<<ROWSHIFT; //number of rows in a tile
+	static const unsigned int ROWMASK=ROWS-1;
+	static const unsigned int COLUMNSHIFT=2;
+	static const unsigned int COLUMNS=1<<COLUMNSHIFT; //number of columns in a tile
+	static const unsigned int COLUMNMASK=COLUMNS-1;
+	static const unsigned int CELLS=ROWS*COLUMNS;
+
+private:
+	vector<Cell> cells;
+	CellAddress origin;
+	//of the CellArray, holding the values of cells
+	Slab &values;
+	StringPool &pool;
+
+	valuetype_t types[CELLS];
+	double numbers[CELLS];
+	uint32_t strings[CELLS]; //handles in the StringPool of the CellArray
+
+	unsigned int levels[CELLS];
+	unsigned int maxlevel; //upper bound of levels
+
+	static_assert(ROWS%64==0,"A column of stale flags must be whole words");
+	uint64_t stale[CELLS/64]; //a bit per cell, by index
+	uint64_t dirty[CELLS/64]; //likewise; a subset of stale
+	unsigned int nstale; //number of bits set in stale
+
+public:
+	//origin is the address of the top-left cell in the tile
+	CellTile(CellAddress origin,Slab &values,StringPool &pool);
+	~CellTile() noexcept;
+
+	//index of the given cell (in sheet coordinates) within its tile
+	static unsigned int index(CellAddress addr) noexcept;
+	//address in the sheet of the cell at the given index
+	CellAddress address(unsigned int idx) const noexcept;
+
+	//unsafe element access, addr in sheet coordinates
+	Cell& operator[](CellAddress addr) noexcept;
+	const Cell& operator[](CellAddress addr) const noexcept;
+
+	//sets the typed value of a cell from its current value; returns
+	//whether that differs from the previous typed value
+	bool publish(unsigned int idx);
+
+	//clears all cells in this tile that are outside the w*h area of the sheet;
+	//returns whether any cells remain inside that area
+	bool clearOutside(unsigned int w,unsigned int h) noexcept;
+};
@@ -2,118 +2,55 @@
 #include "cellvalue.h"
 #include "celladdress.h"
 #include "spreadsheet.h"
-#include "conversion.h"
+#include "numberformat.h"
+#include "slab.h"
 #include "formula.h"
-#include <sstream>
 
 using namespace std;
 
-CellValue::~CellValue() noexcept {}
+static const string dependencyError="FERR:Error in formula dependencies";
 
-CellValue* CellValue::cellValueFromString(string s) noexcept {
-	Maybe<int> intval=convertstring<int>(s);
-	if(intval.isJust()){
-		return new CellValueBasic<int>(intval.fromJust());
-	}
-	Maybe<double> doubleval=convertstring<double>(s);
-	if(doubleval.isJust()){
-		return new CellValueBasic<double>(doubleval.fromJust());
-	}
-	if(s.size()&&s[0]=='='){
-		Either<string,CellValueFormula*> mcv=CellValueFormula::parseAndCreateFormula(s);
-		if(mcv.isLeft()){
-			return new CellValueError("Invalid formula: "+mcv.fromLeft(),s);
-		}
-		return mcv.fromRight();
-	}
-	return new CellValueBasic<string>(s);
-}
-
-
-
-template <typename T>
-string CellValueBasic<T>::getDisplayString() const noexcept {
-	stringstream ss;
-	ss<<value;
-	return ss.str();
-}
-
-template <>
-string CellValueBasic<string>::getDisplayString() const noexcept {
-	return value;
-}
-
-template <typename T>
-string CellValueBasic<T>::getEditString() const noexcept {
-	return getDisplayString();
-}
-
-template <typename T>
-bool CellValueBasic<T>::update(const CellArray &) noexcept {
-	return false;
-}
-
-template <typename T>
-vector<CellAddress> CellValueBasic<T>::getDependencies() const noexcept {
-	return vector<CellAddress>();
-}
-
-
-
-Either<string,CellValueFormula*> CellValueFormula::parseAndCreateFormula(string s) noexcept {
-	Either<string,Formula*> mparsed=Formula::parse(s.substr(1));
-	if(mparsed.isLeft())return mparsed.fromLeft();
-	CellValueFormula *cv=new CellValueFormula;
-	cv->parsed=mparsed.fromRight();
-	cv->editString=s;
-	return cv;
-}
-
-string CellValueFormula::getDisplayString() const noexcept {
-	return dispString;
-}
+CellValueFormula::CellValueFormula(shared_ptr<const Formula> parsed) noexcept
+	:parsed(move(parsed)){}
 
-string CellValueFormula::getEditString() const noexcept {
-	return editString;
+Either<string,CellValueFormula*> CellValueFormula::parseAndCreateFormula(string s,CellAddress addr,
+                                                                        Slab &slab) noexcept {
+	Either<string,shared_ptr<const Formula>> mparsed=Formula::parse(s.substr(1),addr);
+	if(mparsed.isLeft())return move(mparsed).fromLeft();
+	return slab.make<CellValueFormula>(move(mparsed).fromRight());
 }
 
-bool CellValueFormula::update(const CellArray &cells) noexcept {
-	Maybe<string> res=parsed->evaluate(cells);
-	if(res.isNothing()){
-		dispString="FERR:Error in formula dependencies";
-	} else dispString=res.fromJust();
-	return false;
-}
-
-vector<CellAddress> CellValueFormula::getDependencies() const noexcept {
-	return parsed->getDependencies();
+string_view CellValueFormula::getDisplayString(char *buf) const noexcept {
+	switch(type){
+		case VT_EMPTY: return string_view();
+		case VT_NUMBER: return string_view(buf,formatNumber(number,buf));
+		case VT_STRING: return str;
+		case VT_ERROR: return dependencyError;
+	}
+	return string_view();
 }
 
-
-
-CellValueError::CellValueError(const string &errString,const string &editString) noexcept
-	:errString(errString),editString(editString){}
-
-string CellValueError::getDisplayString() const noexcept {
-	return "ERR:"+errString;
+string CellValueFormula::getEditString(CellAddress addr) const noexcept {
+	return "="+parsed->getText(addr);
 }
 
-string CellValueError::getEditString() const noexcept {
-	return editString;
+void CellValueFormula::update(const CellArray &cells,CellAddress addr,
+                              const ChangeList *changes) noexcept {
+	type=parsed->evaluate(cells,addr,callstates,changes,number,str);
+	if(type!=VT_STRING)str.clear();
 }
 
-string CellValueError::getErrorString() const noexcept {
-	return errString;
+valuetype_t CellValueFormula::getValue(double &number,string_view &str) const noexcept {
+	number=this->number;
+	if(type==VT_ERROR){
+		str=dependencyError;
+		return VT_STRING;
+	}
+	str=this->str;
+	return type;
 }
 
-bool CellValueError::update(const CellArray &) noexcept {
-	return true;
+Dependencies CellValueFormula::getDependencies(CellAddress addr) const noexcept {
+	return parsed->getDependencies(addr);
 }
 
-vector<CellAddress> CellValueError::getDependencies() const noexcept {
-	CellValue *cv=CellValue::cellValueFromString(editString);
-	if(dynamic_cast<CellValueError*>(cv))return vector<CellAddress>();
-	vector<CellAddress> deps=cv->getDependencies();
-	delete cv;
-	return deps;
-}
@@ -2,93 +2,52 @@
 
 #include "maybe.h"
 #include "either.h"
+#include "formula.h"
+#include "cell.h"
 #include <string>
 #include <vector>
+#include <memory>
 
 using namespace std;
 
 /*
-A number of classes, all subclass of CellValue, to be used in Cell. Basic values
-are covered in CellValueBasic, formulas in CellValueFormula, and error values
-in CellValueError. The last distinction is necessary, because an error cell also
-needs to store its original edit string, alongside the error string. This dual
-string storage is unique to the error cell.
+The value of a formula Cell, which doesn't fit inline in it: the parsed formula
+and its evaluated result.
 */
 
 class CellArray;
 class CellAddress;
+class Dependencies;
+struct ChangeList;
+class Slab;
+
+//The edit string isn't stored, but reconstructed from the (possibly shared)
+//Formula. The result is kept typed; the display string of a number is only
+//made when asked for, and that of a failed evaluation is shared.
+class CellValueFormula{
+	shared_ptr<const Formula> parsed;
+	valuetype_t type=VT_EMPTY; //VT_NUMBER, VT_STRING or VT_ERROR once updated
+	double number=0;
+	string str;
+	vector<Formula::CallState> callstates;
 
-class CellValue{
 public:
-	virtual ~CellValue() noexcept;
+	CellValueFormula(shared_ptr<const Formula> parsed) noexcept;
 
-	//returns a newly made cell with this value
-	//addr is its location in the sheet;
-	//not updated yet, do that with update()
-	static CellValue* cellValueFromString(string s) noexcept;
-
-	virtual string getDisplayString() const = 0;
-	virtual string getEditString() const = 0;
-
-	//updates the cell, using possibly changed values of its dependencies
-	//returns true if the cell must be regenerated with cellValueFromString
-	virtual bool update(const CellArray &cells) = 0;
-
-	//returns list of dependencies for this cell
-	virtual vector<CellAddress> getDependencies() const = 0;
-};
-
-template <typename T>
-class CellValueBasic : public CellValue{
-	T value;
-
-public:
-	CellValueBasic(T value) noexcept
-		:value(value){}
-
-	string getDisplayString() const noexcept;
-	string getEditString() const noexcept;
-
-	bool update(const CellArray &cells) noexcept;
-
-	vector<CellAddress> getDependencies() const noexcept;
-};
-
-
-class Formula;
-
-class CellValueFormula : public CellValue{
-	Formula *parsed;
-	string dispString;
-	string editString;
-
-	CellValueFormula() = default;
-
-public:
-	//returns Nothing() on parse error
+	//returns the parse error on failure
 	//not update()'d yet!
-	static Either<string,CellValueFormula*> parseAndCreateFormula(string s) noexcept;
-
-	string getDisplayString() const noexcept;
-	string getEditString() const noexcept;
-
-	bool update(const CellArray &cells) noexcept;
-
-	vector<CellAddress> getDependencies() const noexcept;
-};
-
-class CellValueError : public CellValue{
-	string errString;
-	string editString;
-
-public:
-	CellValueError(const string &errString,const string &editString) noexcept;
+	static Either<string,CellValueFormula*> parseAndCreateFormula(string s,CellAddress addr,
+	                                                              Slab &slab) noexcept;
 
-	string getDisplayString() const noexcept;
-	string getEditString() const noexcept;
-	string getErrorString() const noexcept;
+	//see Cell::getDisplayString
+	string_view getDisplayString(char *buf) const noexcept;
+	string getEditString(CellAddress addr) const noexcept;
+	//an evaluation error is a string value
+	valuetype_t getValue(double &number,string_view &str) const noexcept;
 
-	bool update(const CellArray &cells) noexcept;
+	//updates the result, using possibly changed values of its dependencies
+	//(see Cell::update)
+	void update(const CellArray &cells,CellAddress addr,const ChangeList *changes) noexcept;
 
-	vector<CellAddress> getDependencies() const noexcept;
+	Dependencies getDependencies(CellAddress addr) const noexcept;
 };
@@ -0,0 +1,40 @@
+#include "columnindex.h"
+#include <algorithm>
+
+using namespace std;
+
+static void add(ColumnIndex::Totals &totals,const ColumnIndex::Totals &other) noexcept {
+	totals.sum+=other.sum;
+	totals.count+=other.count;
+	totals.inexact+=other.inexact;
+}
+
+void ColumnIndex::recompute(size_t i) noexcept {
+	tree[i]=tree[2*i];
+	add(tree[i],tree[2*i+1]);
+}
+
+void ColumnIndex::set(size_t block,Totals totals){
+	if(block>=capacity){
+		size_t newcapacity=max(capacity,(size_t)16);
+		while(newcapacity<=block)newcapacity*=2;
+		vector<Totals> newtree(2*newcapacity,Totals{0,0,0});
+		copy(tree.begin()+capacity,tree.end(),newtree.begin()+newcapacity);
+		tree.swap(newtree);
+		capacity=newcapacity;
+		for(size_t i=capacity-1;i>=1;i--)recompute(i);
+	}
+	size_t i=capacity+block;
+	tree[i]=totals;
+	for(i/=2;i>=1;i/=2)recompute(i);
+}
+
+void ColumnIndex::query(size_t from,size_t to,Totals &totals) const noexcept {
+	if(from>to||from>=capacity)return;
+	to=min(to,capacity-1);
+	//the usual bottom-up walk, over the half-open range of leaves [l,r)
+	for(size_t l=from+capacity,r=to+1+capacity;l<r;l/=2,r/=2){
+		if(l&1)add(totals,tree[l++]);
+		if(r&1)add(totals,tree[--r]);
+	}
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+using namespace std;
+
+/*
+An index of the aggregates of one column of a sheet, for SUM, AVG and COUNT
+over long ranges. The column is divided in blocks of rows (the tiles of
+CellArray); the index keeps the totals of every block, and answers the totals
+over any run of blocks in logarithmic time.
+
+This is a segment tree, stored implicitly in a vector with the blocks as the
+leaves. Unlike prefix sums, every node is recomputed from its children when a
+block changes, so no rounding errors accumulate and NaN's and infinities
+disappear again when the values causing them do.
+*/
+
+class ColumnIndex{
+public:
+	struct Totals{
+		double sum;
+		size_t count; //non-empty cells
+		size_t inexact; //numbers that aren't exact integers (see aggregate.h)
+	};
+
+private:
+	vector<Totals> tree; //node i has children 2i and 2i+1; leaves from capacity
+	size_t capacity=0; //number of leaves, a power of two
+
+	void recompute(size_t i) noexcept;
+
+public:
+	//sets the totals of a block, growing the index if needed
+	void set(size_t block,Totals totals);
+
+	//adds the totals of blocks from up to and including to
+	void query(size_t from,size_t to,Totals &totals) const noexcept;
+};
@@ -80,9 +80,36 @@ const unordered_map<string,function<SheetController::CommandRet(SheetController&
 	{"l",[](SheetController &self){return commands.at("load")(self);}},
 	{"edit",[](SheetController &self){return commands.at("load")(self);}},
 	{"e",[](SheetController &self){return commands.at("load")(self);}},
+
+	{"recalc",[](SheetController &self){
+		self.sheet.recalculateStale();
+		self.view.redraw();
+		self.view.displayStatusString("Recalculated.");
+		return CR_OK;
+	}},
+
+	{"calcmode",[](SheetController &self){
+		static const char *const names[] = {"automatic", "lazy", "manual"};
+		Maybe<string> mmode = self.view.askStringOfUser("Calculation mode (automatic/lazy/manual):",
+		                                                names[self.sheet.getCalcMode()]);
+		if (mmode.isNothing()) {
+			return CR_CANCELLED;
+		}
+		const string &mode = mmode.fromJust();
+		for (int i = 0; i < 3; i++) {
+			if (mode == names[i]) {
+				self.sheet.setCalcMode((calcmode_t)i);
+				self.view.redraw();
+				self.view.displayStatusString("Calculation mode: " + mode);
+				return CR_OK;
+			}
+		}
+		self.view.displayStatusString("Unknown calculation mode '" + mode + "'!");
+		return CR_FAIL;
+	}},
 };
 
-SheetController::SheetController(string fname) : sheet(20, 20), view(sheet), fname(fname) {
+SheetController::SheetController(string fname) : view(sheet), fname(fname) {
 	if (!fname.empty()) {
 		sheet.loadFromDisk(fname);
 	}
@@ -3,6 +3,8 @@
 #include "spreadsheet.h"
 #include "view.h"
 #include <string>
+#include <unordered_map>
+#include <functional>
 
 /*
 The class that does the I/O and connects the model and the view together.
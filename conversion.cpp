@@ -1,42 +1,80 @@
 #include "conversion.h"
-#include "util.h"
-#include <stdexcept>
+#include <charconv>
+#include <climits>
+#include <cctype>
+#include <algorithm>
+#include <string>
+#include <cmath>
+#include <cerrno>
+#include <cstdlib>
 
 using namespace std;
 
-template <>
-Maybe<int> convertstring<int>(string s) noexcept {
-	s=trimright(s);
-	size_t endpos;
-	int intval;
-	try {
-		intval=stoi(s,&endpos,0);
-	} catch(invalid_argument e){
-		return Nothing();
-	} catch(out_of_range e){
-		return Nothing();
-	}
-	if(endpos!=s.size())return Nothing();
-	return intval;
+//like strtol with base 0: an optional 0x prefix for hexadecimal, else a
+//leading 0 for octal
+static bool parseInt(const char *p,const char *end,int &intval) noexcept {
+	const bool negative=*p=='-';
+	if(*p=='-'||*p=='+')p++;
+	int base=10;
+	if(end-p>=3&&p[0]=='0'&&(p[1]=='x'||p[1]=='X')&&isxdigit((unsigned char)p[2])){
+		base=16;
+		p+=2;
+	} else if(p<end&&p[0]=='0')base=8;
+	unsigned long long mag; //unsigned, so that a second sign is rejected
+	const from_chars_result res=from_chars(p,end,mag,base);
+	if(res.ec!=errc()||res.ptr!=end)return false;
+	if(mag>(negative?-(unsigned long long)INT_MIN:(unsigned long long)INT_MAX))return false;
+	intval=negative?(int)-mag:(int)mag;
+	return true;
 }
 
-template <>
-Maybe<double> convertstring<double>(string s) noexcept {
-	s=trimright(s);
-	size_t endpos;
-	double doubleval;
-	try {
-		doubleval=stod(s,&endpos);
-	} catch(invalid_argument e){
-		return Nothing();
-	} catch(out_of_range e){
-		return 1/0.0; //==inf
+//like strtod, including hexadecimal, inf and nan; numbers out of range are inf,
+//as stod made them
+static bool parseDouble(const char *p,const char *end,double &doubleval) noexcept {
+	const char *const start=p;
+	const bool negative=*p=='-';
+	if(*p=='-'||*p=='+')p++;
+	if(p<end&&*p=='-')return false; //from_chars takes a sign itself
+	from_chars_result res;
+	if(end-p>=3&&p[0]=='0'&&(p[1]=='x'||p[1]=='X')&&
+			(isxdigit((unsigned char)p[2])||p[2]=='.')){
+		//libstdc++ takes two signs in a hexadecimal exponent
+		const char *exp=find_if(p,end,[](char c){return c=='p'||c=='P';});
+		if(end-exp>=3&&(exp[1]=='+'||exp[1]=='-')&&(exp[2]=='+'||exp[2]=='-'))return false;
+		res=from_chars(p+2,end,doubleval,chars_format::hex);
+	} else res=from_chars(p,end,doubleval);
+	if(res.ptr!=end)return false;
+	if(res.ec==errc::result_out_of_range){
+		doubleval=1/0.0;
+		return true;
+	}
+	if(res.ec!=errc())return false;
+	if(fpclassify(doubleval)==FP_SUBNORMAL){
+		//strtod also reports subnormals that aren't exact as out of range,
+		//which from_chars can't tell; rare enough to just ask strtod
+		const string copy(start,end);
+		errno=0;
+		strtod(copy.c_str(),nullptr);
+		if(errno==ERANGE){
+			doubleval=1/0.0;
+			return true;
+		}
 	}
-	if(endpos!=s.size())return Nothing();
-	return doubleval;
+	if(negative)doubleval=-doubleval;
+	return true;
 }
 
-template <>
-Maybe<string> convertstring<string>(string s) noexcept {
-	return s;
+numberkind_t parseNumber(string_view s,int &intval,double &doubleval) noexcept {
+	const char *p=s.data(),*end=p+s.size();
+	while(p<end&&isspace((unsigned char)*p))p++;
+	while(end>p&&isspace((unsigned char)end[-1]))end--;
+	if(p==end)return NK_NONE;
+	//anything else must start with a sign, a digit, a '.', or the i and n of
+	//inf and nan
+	const char c=*p;
+	if(c!='+'&&c!='-'&&c!='.'&&!isdigit((unsigned char)c)&&
+			c!='i'&&c!='I'&&c!='n'&&c!='N')return NK_NONE;
+	if(parseInt(p,end,intval))return NK_INT;
+	if(parseDouble(p,end,doubleval))return NK_DOUBLE;
+	return NK_NONE;
 }
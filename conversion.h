@@ -1,14 +1,22 @@
 #pragma once
 
-#include "maybe.h"
-#include <string>
+#include <string_view>
 
 using namespace std;
 
 /*
-A conversion function from string to some basic types. Used when making a
-CellValueBasic.
+Recognition of the numbers in edit strings. Used when setting the value of a Cell.
+Numbers are read like stoi (with base 0) and stod would, allowing whitespace
+around them, but in a single pass over the string, without exceptions or
+allocation, since most strings in a text-heavy sheet aren't numbers at all.
 */
 
-template <typename T>
-Maybe<T> convertstring(string s) noexcept;
+enum numberkind_t : unsigned char {
+	NK_NONE,
+	NK_INT,
+	NK_DOUBLE
+};
+
+//classifies s, setting intval for NK_INT and doubleval for NK_DOUBLE; a
+//string that is a valid int is never NK_DOUBLE
+numberkind_t parseNumber(string_view s,int &intval,double &doubleval) noexcept;
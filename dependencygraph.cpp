@@ -0,0 +1,144 @@
+#include "dependencygraph.h"
+#include <cstring>
+
+using namespace std;
+
+uint32_t DependencyGraph::acquire(CellAddress addr){
+	auto [it,inserted]=ids.try_emplace(addr,0);
+	if(!inserted)return it->second;
+	uint32_t id;
+	if(freeids.size()){
+		id=freeids.back();
+		freeids.pop_back();
+		addresses[id]=addr;
+		uses[id]=0;
+		edges[id]=Edges();
+	} else {
+		id=addresses.size();
+		addresses.push_back(addr);
+		uses.push_back(0);
+		edges.emplace_back();
+	}
+	it->second=id;
+	return id;
+}
+
+void DependencyGraph::release(unordered_map<CellAddress,uint32_t>::iterator it) noexcept {
+	const uint32_t id=it->second;
+	if(--uses[id]>0)return;
+	discard(edges[id]);
+	edges[id]=Edges();
+	positions.erase(id);
+	ids.erase(it);
+	freeids.push_back(id);
+}
+
+uint32_t* DependencyGraph::data(Edges &e) noexcept {
+	return e.capacity>INLINE?pool.data()+e.offset:e.local;
+}
+
+const uint32_t* DependencyGraph::data(const Edges &e) const noexcept {
+	return e.capacity>INLINE?pool.data()+e.offset:e.local;
+}
+
+void DependencyGraph::grow(Edges &e){
+	const uint32_t capacity=2*e.capacity;
+	const size_t offset=pool.size();
+	pool.resize(offset+capacity);
+	memcpy(pool.data()+offset,data(e),e.size*sizeof(uint32_t));
+	discard(e);
+	e.offset=offset;
+	e.capacity=capacity;
+}
+
+void DependencyGraph::discard(Edges &e) noexcept {
+	if(e.capacity>INLINE)garbage+=e.capacity;
+}
+
+void DependencyGraph::compact(){
+	vector<uint32_t> newpool;
+	newpool.reserve(pool.size()-garbage);
+	for(Edges &e : edges){
+		if(e.capacity<=INLINE)continue;
+		const size_t offset=newpool.size();
+		newpool.insert(newpool.end(),pool.begin()+e.offset,pool.begin()+e.offset+e.capacity);
+		e.offset=offset;
+	}
+	pool=move(newpool);
+	garbage=0;
+}
+
+bool DependencyGraph::insert(CellAddress dependency,CellAddress dependent){
+	const uint32_t a=acquire(dependency),b=acquire(dependent);
+	Edges &e=edges[a];
+	auto index=positions.find(a);
+	if(index!=positions.end()){
+		if(index->second.count(b))return false;
+	} else {
+		const uint32_t *d=data(e);
+		for(uint32_t k=0;k<e.size;k++){
+			if(d[k]==b)return false;
+		}
+	}
+	if(e.size==e.capacity)grow(e);
+	data(e)[e.size]=b;
+	if(index!=positions.end())index->second.emplace(b,e.size);
+	e.size++;
+	if(e.size==INDEX_THRESHOLD&&index==positions.end()){
+		unordered_map<uint32_t,uint32_t> &newindex=positions[a];
+		const uint32_t *d=data(e);
+		for(uint32_t k=0;k<e.size;k++)newindex.emplace(d[k],k);
+	}
+	uses[a]++;
+	uses[b]++;
+	if(2*garbage>pool.size())compact();
+	return true;
+}
+
+bool DependencyGraph::erase(CellAddress dependency,CellAddress dependent) noexcept {
+	auto ita=ids.find(dependency),itb=ids.find(dependent);
+	if(ita==ids.end()||itb==ids.end())return false;
+	const uint32_t a=ita->second,b=itb->second;
+	Edges &e=edges[a];
+	uint32_t *d=data(e);
+	auto index=positions.find(a);
+	uint32_t pos=e.size;
+	if(index!=positions.end()){
+		auto it=index->second.find(b);
+		if(it!=index->second.end()){
+			pos=it->second;
+			index->second.erase(it);
+		}
+	} else {
+		for(pos=0;pos<e.size&&d[pos]!=b;pos++);
+	}
+	if(pos==e.size)return false;
+	//order doesn't matter, so fill the hole with the last edge
+	e.size--;
+	if(pos<e.size){
+		d[pos]=d[e.size];
+		if(index!=positions.end())index->second[d[pos]]=pos;
+	}
+	if(index!=positions.end()&&e.size<INDEX_THRESHOLD/2)positions.erase(index);
+	if(e.capacity>INLINE&&e.size<=INLINE){
+		uint32_t local[INLINE];
+		memcpy(local,d,e.size*sizeof(uint32_t));
+		discard(e);
+		memcpy(e.local,local,e.size*sizeof(uint32_t));
+		e.capacity=INLINE;
+	}
+	if(a==b){
+		uses[a]--;
+	} else release(itb);
+	release(ita);
+	if(2*garbage>pool.size())compact();
+	return true;
+}
+
+void DependencyGraph::dependents(CellAddress addr,vector<CellAddress> &out) const {
+	auto it=ids.find(addr);
+	if(it==ids.end())return;
+	const Edges &e=edges[it->second];
+	const uint32_t *d=data(e);
+	for(uint32_t k=0;k<e.size;k++)out.push_back(addresses[d[k]]);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "celladdress.h"
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+using namespace std;
+
+/*
+The dependencies of cells on single other cells, stored as reverse edges: for
+every cell, the cells that depend on it. Cells in the graph get a 32-bit id,
+and the edges of a cell are an array of ids, kept inline for up to INLINE
+edges, and otherwise in a shared pool. An array that outgrows its place in the
+pool moves to the end, leaving garbage that is compacted away once it makes
+up half of the pool. A cell with many dependents also gets an index of the
+positions of its edges, so that removing one doesn't need a scan.
+A cell leaves the graph, and its id is reused, when it has no edges left in
+either direction.
+*/
+
+class DependencyGraph{
+	static const uint32_t INLINE=4;
+	static const uint32_t INDEX_THRESHOLD=64; //edges from which a cell gets an index
+
+	struct Edges{
+		uint32_t size=0,capacity=INLINE;
+		union{
+			uint32_t local[INLINE];
+			uint32_t offset; //in pool, if capacity>INLINE
+		};
+	};
+
+	unordered_map<CellAddress,uint32_t> ids;
+	vector<CellAddress> addresses; //by id
+	vector<uint32_t> uses; //by id: edges from and to the cell
+	vector<Edges> edges; //by id
+	vector<uint32_t> freeids;
+
+	vector<uint32_t> pool;
+	size_t garbage=0; //unused entries in pool
+
+	//by id, for cells with at least INDEX_THRESHOLD edges: position of each
+	//dependent in their edges
+	unordered_map<uint32_t,unordered_map<uint32_t,uint32_t>> positions;
+
+	uint32_t acquire(CellAddress addr);
+	//drops a use of the cell at it, removing it if that was the last
+	void release(unordered_map<CellAddress,uint32_t>::iterator it) noexcept;
+
+	uint32_t* data(Edges &e) noexcept;
+	const uint32_t* data(const Edges &e) const noexcept;
+	//moves the edges to a larger array at the end of the pool
+	void grow(Edges &e);
+	//frees the pool array of e, if any
+	void discard(Edges &e) noexcept;
+	void compact();
+
+public:
+	//adds an edge; returns false if it was already present
+	bool insert(CellAddress dependency,CellAddress dependent);
+	//removes an edge; returns false if it wasn't present
+	bool erase(CellAddress dependency,CellAddress dependent) noexcept;
+
+	//appends the cells that directly depend on addr to out, in no particular
+	//order
+	void dependents(CellAddress addr,vector<CellAddress> &out) const;
+};
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <cstddef>
+#include <utility> //for move()
+#include <new> //for placement new
 
 /*
 Either one type, or another. Mostly used to be able to return "either
@@ -8,74 +10,125 @@ a value, or an error string", in which case it is some form of
 Either<string,T>. The "good" value should always be the right one, if
 applicable, because that should be the "right one". For obvious reasons.
 The error value then becomes left.
+Like Maybe, the value is stored inside the Either, and the accessors on a
+temporary Either move the value out.
 */
 
 template <typename T,typename U>
 class Either{
-	const T *left;
-	const U *right;
+	union{
+		T left;
+		U right;
+	};
+	bool isleft;
 
-	Either(T *left,U *right) noexcept;
 public:
 	~Either() noexcept;
 	Either(T value) noexcept; //makes a Left-value for you
 	Either(U value) noexcept; //makes a Right-value for you
 
+	Either(const Either &other) noexcept;
+	Either(Either &&other) noexcept;
+	Either& operator=(const Either &other) noexcept;
+	Either& operator=(Either &&other) noexcept;
+
 	static Either<T,U> Left(T value) noexcept; //makes a Left-value for you
 	static Either<T,U> Right(U value) noexcept; //makes a Right-value for you
 
-	T fromLeft(void) const noexcept; //gets the Left-value, assuming it is one
-	U fromRight(void) const noexcept; //gets the Right-value, assuming it is one
+	//gets the Left-value, assuming it is one
+	const T& fromLeft(void) const & noexcept;
+	T fromLeft(void) && noexcept;
+	//gets the Right-value, assuming it is one
+	const U& fromRight(void) const & noexcept;
+	U fromRight(void) && noexcept;
 
 	bool isLeft(void) const noexcept; //query whether this is a Left-value
 	bool isRight(void) const noexcept; //query whether this is a Right-value
 };
 
-template <typename T,typename U>
-Either<T,U>::Either(T *left,U *right) noexcept
-	:left(left),right(right){}
-
 template <typename T,typename U>
 Either<T,U>::~Either() noexcept {
-	if(left)delete left;
-	if(right)delete right;
+	if(isleft)left.~T();
+	else right.~U();
 }
 
 template <typename T,typename U>
 Either<T,U>::Either(T value) noexcept
-	:left(new T(move(value))),right(nullptr){}
+	:left(std::move(value)),isleft(true){}
 
 template <typename T,typename U>
 Either<T,U>::Either(U value) noexcept
-	:left(nullptr),right(new U(move(value))){}
+	:right(std::move(value)),isleft(false){}
+
+template <typename T,typename U>
+Either<T,U>::Either(const Either &other) noexcept
+		:isleft(other.isleft){
+	if(isleft)new(&left) T(other.left);
+	else new(&right) U(other.right);
+}
+
+template <typename T,typename U>
+Either<T,U>::Either(Either &&other) noexcept
+		:isleft(other.isleft){
+	if(isleft)new(&left) T(std::move(other.left));
+	else new(&right) U(std::move(other.right));
+}
+
+template <typename T,typename U>
+Either<T,U>& Either<T,U>::operator=(const Either &other) noexcept {
+	if(this!=&other){
+		this->~Either();
+		new(this) Either(other);
+	}
+	return *this;
+}
+
+template <typename T,typename U>
+Either<T,U>& Either<T,U>::operator=(Either &&other) noexcept {
+	if(this!=&other){
+		this->~Either();
+		new(this) Either(std::move(other));
+	}
+	return *this;
+}
 
 template <typename T,typename U>
 Either<T,U> Either<T,U>::Left(T value) noexcept {
-	return Either<T,U>(new T(move(value)),nullptr);
+	return Either<T,U>(std::move(value));
 }
 
 template <typename T,typename U>
 Either<T,U> Either<T,U>::Right(U value) noexcept {
-	return Either<T,U>(nullptr,new U(move(value)));
+	return Either<T,U>(std::move(value));
+}
+
+
+template <typename T,typename U>
+const T& Either<T,U>::fromLeft() const & noexcept {
+	return left;
 }
 
+template <typename T,typename U>
+T Either<T,U>::fromLeft() && noexcept {
+	return std::move(left);
+}
 
 template <typename T,typename U>
-T Either<T,U>::fromLeft() const noexcept {
-	return *left;
+const U& Either<T,U>::fromRight() const & noexcept {
+	return right;
 }
 
 template <typename T,typename U>
-U Either<T,U>::fromRight() const noexcept {
-	return *right;
+U Either<T,U>::fromRight() && noexcept {
+	return std::move(right);
 }
 
 template <typename T,typename U>
 bool Either<T,U>::isLeft() const noexcept {
-	return (bool)left;
+	return isleft;
 }
 
 template <typename T,typename U>
 bool Either<T,U>::isRight() const noexcept {
-	return (bool)right;
+	return !isleft;
 }
@@ -2,37 +2,18 @@
 #include "cell.h"
 #include "cellvalue.h"
 #include "formula.h"
-#include "conversion.h"
-#include <sstream>
+#include "aggregate.h"
 #include <unordered_map>
-#include <functional>
+#include <mutex>
 #include <cstring>
 #include <cmath>
 #include <cctype>
 #include <climits>
+#include <charconv>
+#include <string_view>
 
 using namespace std;
 
-Formula::ASTNode::ASTNode(astnodetype_t type,double numval) noexcept
-	:type(type),numval(numval){}
-
-Formula::ASTNode::ASTNode(astnodetype_t type,string strval) noexcept
-	:type(type),strval(strval){}
-
-Formula::ASTNode::ASTNode(astnodetype_t type,CellAddress addrval) noexcept
-	:type(type),addrval(addrval){}
-
-Formula::ASTNode::ASTNode(astnodetype_t type,CellRange rangeval) noexcept
-	:type(type),rangeval(rangeval){}
-
-Formula::ASTNode::~ASTNode() noexcept {
-	for(ASTNode *node : children){
-		delete node;
-	}
-}
-
-
-
 enum tokentype_t{
 	TT_STRING,
 	TT_NUMBER,
@@ -42,104 +23,138 @@ enum tokentype_t{
 	TT_SYMBOL
 };
 
+enum optype_t{
+	OT_LPAREN,
+	OT_RPAREN,
+	OT_ADD,
+	OT_SUB,
+	OT_NEG, //the unary minus
+	OT_MUL,
+	OT_DIV,
+	OT_MOD,
+	OT_POW
+};
+
+//Tokens refer into the formula text; strings are left escaped, since they're
+//hardly ever needed
 class Formula::Token{
 public:
 	tokentype_t type;
-	string value;
-
-	Token(tokentype_t type) noexcept;
-	Token(tokentype_t type,string value) noexcept;
+	optype_t op; //for TT_SYMBOL
+	string_view text; //excluding the quotes for TT_STRING
+	int pos; //index in the formula
+	double number; //for TT_NUMBER
 };
 
-Formula::Token::Token(tokentype_t type) noexcept
-	:type(type){}
 
-Formula::Token::Token(tokentype_t type,string value) noexcept
-	:type(type),value(value){}
 
+//The spreadsheet formula functions. Each aggregates its range to a total, either
+//the sum of the numbers or the number of non-empty cells, from which finish
+//computes the result.
+struct Formula::Function{
+	string_view name;
+	bool counts;
+	double (*finish)(double total,CellRange range);
+};
+
+static double identity(double total,CellRange) noexcept {
+	return total;
+}
 
+static double average(double sum,CellRange range) noexcept {
+	if(std::isnan(sum))return sum;
+	return sum/range.size();
+}
 
-//The spreadsheet formula functions
-const unordered_map<string,function<double(const CellArray&,CellRange)>> functionmap={
-	{"SUM",[](const CellArray &cells,CellRange range) -> double {
-		double res=0;
-		for(const Cell &cell : cells.range(range)){
-			Maybe<double> mitem=convertstring<double>(cell.getDisplayString());
-			if(mitem.isNothing())continue;
-			res+=mitem.fromJust();
-		}
-		return res;
-	}},
-	{"AVG",[](const CellArray &cells,CellRange range) -> double {
-		double sum=functionmap.at("SUM")(cells,range);
-		if(std::isnan(sum))return sum;
-		return sum/range.size();
-	}},
-	{"COUNT",[](const CellArray &cells,CellRange range) -> double {
-		int count=0;
-		for(const Cell &cell : cells.range(range)){
-			count+=cell.getDisplayString().size()!=0;
-		}
-		return count;
-	}}
+const Formula::Function Formula::functions[]={
+	{"SUM",false,identity},
+	{"AVG",false,average},
+	{"COUNT",true,identity}
 };
 
 
 
-//assumes that the char under the cursor is an uppercase character
-Maybe<Formula::Token> Formula::tryTokeniseNameAddressRange(const string &formula,
-                                                           int &cursor) noexcept {
+//reads an address that the tokeniser accepted, like fromRepresentation
+static CellAddress readAddress(string_view text) noexcept {
+	unsigned int row=0,column=0;
+	size_t i;
+	for(i=0;isupper(text[i]);i++)column=26*column+text[i]-'A'+1;
+	for(;i<text.size();i++)row=10*row+text[i]-'0';
+	return CellAddress(row-1,column-1);
+}
+
+//whether readAddress(text).toRepresentation()==text, which fails for things
+//like "A01"
+static bool addressRoundtrips(string_view text) noexcept {
+	size_t letters=0;
+	while(isupper(text[letters]))letters++;
+	//addresses that can't overflow and have no leading zeros are fine; check
+	//the rest the slow way
+	if(letters<=6&&text.size()-letters<=9&&
+	   (text[letters]!='0'||letters==text.size()-1))return true;
+	return readAddress(text).toRepresentation()==text;
+}
+
+//assumes that the char under the cursor is an uppercase character; returns
+//false for an invalid range
+static bool tokeniseNameAddressRange(string_view formula,int &cursor,
+                                     tokentype_t &type) noexcept {
 	int len=formula.size();
-	int start=cursor;
 	for(cursor++;cursor<len;cursor++){ //first letters
 		if(!isupper(formula[cursor]))break;
 	}
 	if(cursor==len||!isdigit(formula[cursor])){
-		return Formula::Token(TT_NAME,formula.substr(start,cursor-start));
+		type=TT_NAME;
+		return true;
 	}
 
 	for(cursor++;cursor<len;cursor++){ //first numbers
 		if(!isdigit(formula[cursor]))break;
 	}
 	if(cursor==len||formula[cursor]!=':'){ //the colon
-		return Formula::Token(TT_ADDRESS,formula.substr(start,cursor-start));
+		type=TT_ADDRESS;
+		return true;
 	}
 
+	const int second=cursor+1;
 	for(cursor++;cursor<len;cursor++){ //second letters
 		if(!isupper(formula[cursor]))break;
 	}
+	if(cursor==second){
+		return false; //AA11:11, missing letters of second address
+	}
 	if(cursor==len||!isdigit(formula[cursor])){
-		return Nothing(); //AA11:AA, missing numbers of second address
+		return false; //AA11:AA, missing numbers of second address
 	}
 
 	for(cursor++;cursor<len;cursor++){ //second numbers
 		if(!isdigit(formula[cursor]))break;
 	}
-	return Formula::Token(TT_RANGE,formula.substr(start,cursor-start));
+	type=TT_RANGE;
+	return true;
 }
 
-//either returns error message or the list of parsed tokens
-Either<string,vector<Formula::Token>> Formula::tokeniseFormula(const string &formula) noexcept {
+//fills tokens, or returns an error message
+Maybe<string> Formula::tokeniseFormula(const string &formula,vector<Token> &tokens) noexcept {
 	int i,len=formula.size();
-	vector<Token> tokens;
+	tokens.clear();
 	bool prevWasOperator=true;
 	for(i=0;i<len;i++){
+		Token token;
+		token.pos=i;
 		if(isspace(formula[i]))continue;
 		else if(formula[i]=='"'||formula[i]=='\''){
 			const char quote=formula[i];
-			Token token(TT_STRING);
 			for(i++;i<len;i++){
 				if(formula[i]==quote)break;
 				if(formula[i]=='\\'){
 					if(i>=len-2)return string("String not closed with a quote");
-					token.value+=formula[i+1];
 					i++;
-				} else {
-					token.value+=formula[i];
 				}
 			}
 			if(i==len)return string("String not closed with a quote");
-			tokens.push_back(move(token));
+			token.type=TT_STRING;
+			token.text=string_view(formula).substr(token.pos+1,i-token.pos-1);
 			prevWasOperator=false;
 		} else if(isdigit(formula[i])||(
 		          i<len-1&&
@@ -148,356 +163,533 @@ Either<string,vector<Formula::Token>> Formula::tokeniseFormula(const string &for
 		          isdigit(formula[i+1]))){
 			const char *iptr=&formula[i];
 			char *endptr;
-			strtod(iptr,&endptr);
-			int nparsed=endptr-iptr;
 			//Because the string passed to strtod always starts with a digit
 			//(or a minus sign followed by a digit), its conversion should always
 			//at least succeed (or be out of range, which doesn't really matter)
-			tokens.emplace_back(TT_NUMBER,formula.substr(i,nparsed));
-			i+=nparsed-1; //set i on the last character parsed
+			token.type=TT_NUMBER;
+			token.number=strtod(iptr,&endptr);
+			i+=endptr-iptr-1; //set i on the last character parsed
 			prevWasOperator=false;
-		} else if(strchr("+-*/%^()",formula[i])!=nullptr){
-			tokens.emplace_back(TT_SYMBOL,string(1,formula[i]));
-			prevWasOperator=formula[i]!=')';
 		} else if(isupper(formula[i])){
-			Maybe<Token> mtoken=tryTokeniseNameAddressRange(formula,i);
-			i--;
-			if(mtoken.isNothing()){
+			if(!tokeniseNameAddressRange(formula,i,token.type)){
 				return string("Invalid adress or range in formula");
 			}
-			tokens.push_back(mtoken.fromJust());
+			token.text=string_view(formula).substr(token.pos,i-token.pos);
+			i--;
 			prevWasOperator=false; //for good order
 		} else {
-			return string("Invalid character '")+formula[i]+"' in formula";
+			token.type=TT_SYMBOL;
+			switch(formula[i]){
+				case '(': token.op=OT_LPAREN; break;
+				case ')': token.op=OT_RPAREN; break;
+				case '+': token.op=OT_ADD; break;
+				case '-': token.op=OT_SUB; break;
+				case '*': token.op=OT_MUL; break;
+				case '/': token.op=OT_DIV; break;
+				case '%': token.op=OT_MOD; break;
+				case '^': token.op=OT_POW; break;
+				default:
+					return string("Invalid character '")+formula[i]+"' in formula";
+			}
+			prevWasOperator=formula[i]!=')';
 		}
+		tokens.push_back(token);
 	}
-	return tokens;
+	return Nothing();
 }
 
 
-unordered_map<string,int> precedencemap={
-	{"(",INT_MIN},
-	{")",INT_MIN},
-	{"+",1},
-	{"-",1},
-	{"(-)",2}, //the unary minus
-	{"*",2},
-	{"/",2},
-	{"%",2},
-	{"^",3}
-};
+static int precedence(optype_t op) noexcept {
+	switch(op){
+		case OT_LPAREN: case OT_RPAREN: return INT_MIN;
+		case OT_ADD: case OT_SUB: return 1;
+		case OT_NEG: case OT_MUL: case OT_DIV: case OT_MOD: return 2;
+		case OT_POW: return 3;
+	}
+	return 0;
+}
 
-unordered_map<string,bool> leftassocmap={
-	{"(",false}, //these should be false to correctly handle '((' cases
-	{")",false},
-
-	{"+",true},
-	{"(-)",true},
-	{"-",true}, //make all operators of the same precedence, the same
-	{"*",true}, //associativity!
-	{"/",true},
-	{"%",true},
-	{"^",false}
-};
+//make all operators of the same precedence, the same associativity!
+static bool leftAssociative(optype_t op) noexcept {
+	//the parentheses should be false to correctly handle '((' cases
+	return op!=OT_LPAREN&&op!=OT_RPAREN&&op!=OT_POW;
+}
+
+static const char* operatorName(optype_t op) noexcept {
+	static const char *const names[]={"(",")","+","-","(-)","*","/","%","^"};
+	return names[op];
+}
+
+//the offset of addr from anchor
+static inline int offset(unsigned int addr,unsigned int anchor) noexcept {
+	return (int)(addr-anchor);
+}
+
+//Appends the code for an operator popped from the operator stack, given depth
+//values on the stack; returns false if there aren't enough of them
+bool Formula::compileOperator(int op,unsigned int &depth) noexcept {
+	Instruction ins;
+	if(op==OT_NEG){
+		if(depth<1)return false;
+		ins.op=OP_NEG;
+	} else {
+		if(depth<2)return false;
+		depth--;
+		switch(op){
+			case OT_ADD: ins.op=OP_ADD; break;
+			case OT_SUB: ins.op=OP_SUB; break;
+			case OT_MUL: ins.op=OP_MUL; break;
+			case OT_DIV: ins.op=OP_DIV; break;
+			case OT_MOD: ins.op=OP_MOD; break;
+			case OT_POW: ins.op=OP_POW; break;
+			default: ins.op=OP_FAIL; break; //an unclosed '('
+		}
+	}
+	code.push_back(ins);
+	return true;
+}
 
-//This uses a modified Dijkstra's Shunting Yard algorithm to parse the expression,
-//given a list of tokens. Instead of building a postfix representation, it
-//immediately constructs the parse tree from the postfix, while it is being
-//generated.
-Either<string,Formula::ASTNode*> Formula::parseExpression(const vector<Token> &tokens) noexcept {
-	vector<ASTNode*> nodestack;
-	vector<string> opstack;
-	ASTNode *node;
+//This uses a modified Dijkstra's Shunting Yard algorithm to parse the
+//expression, given a list of tokens. The postfix representation it generates
+//is directly the bytecode, so no parse tree is built; the value stack is only
+//tracked by its depth.
+Maybe<string> Formula::compile(const vector<Token> &tokens,CellAddress anchor) noexcept {
+	thread_local vector<optype_t> opstack;
+	opstack.clear();
+	unsigned int depth=0;
+	int stringtoken=-1;
+	code.reserve(tokens.size());
 
 	bool prevWasOperator=true;
 
 	const int len=tokens.size();
 
 	for(int i=0;i<len;i++){
+		Instruction ins;
 		switch(tokens[i].type){
 			case TT_STRING:
-				nodestack.push_back(new ASTNode(AN_STRING,tokens[i].value));
-				prevWasOperator=false;
+				//only valid as the complete formula; see the end
+				ins.op=OP_STRING;
+				stringtoken=i;
 				break;
 			case TT_NUMBER:
-				nodestack.push_back(new ASTNode(
-					AN_NUMBER,
-					strtod(tokens[i].value.data(),nullptr)
-				));
-				prevWasOperator=false;
+				ins.op=OP_NUMBER;
+				ins.number=tokens[i].number;
 				break;
-			case TT_ADDRESS:
-				nodestack.push_back(new ASTNode(
-					AN_ADDRESS,
-					CellAddress::fromRepresentation(tokens[i].value).fromJust()
-				));
-				prevWasOperator=false;
+			case TT_ADDRESS:{
+				const CellAddress addr=readAddress(tokens[i].text);
+				ins.op=OP_CELL;
+				ins.address={offset(addr.row,anchor.row),offset(addr.column,anchor.column)};
+				noperands++;
 				break;
+			}
 			case TT_RANGE:
-				for(ASTNode *node : nodestack)delete node;
 				return string("Range outside of function call");
-			case TT_NAME:
+			case TT_NAME:{
 				if(i>len-4||
 				   tokens[i+1].type!=TT_SYMBOL||
-				   tokens[i+1].value!="("||
+				   tokens[i+1].op!=OT_LPAREN||
 				   (tokens[i+2].type!=TT_ADDRESS&&tokens[i+2].type!=TT_RANGE)||
 				   tokens[i+3].type!=TT_SYMBOL||
-				   tokens[i+3].value!=")"){
-					for(ASTNode *node : nodestack)delete node;
+				   tokens[i+3].op!=OT_RPAREN){
 					return string("Unterminated function call");
 				}
-				if(functionmap.find(tokens[i].value)==functionmap.end()){
-					for(ASTNode *node : nodestack)delete node;
-					return "Unknown function "+tokens[i].value;
+				const Function *function=nullptr;
+				for(const Function &entry : functions){
+					if(entry.name==tokens[i].text)function=&entry;
 				}
-				node=new ASTNode(AN_FUNCTION,tokens[i].value);
-				if(tokens[i+2].type==TT_ADDRESS){
-					node->children.push_back(new ASTNode(
-						AN_ADDRESS,
-						CellAddress::fromRepresentation(tokens[i+2].value).fromJust()
-					));
-				} else {
-					node->children.push_back(new ASTNode(
-						AN_RANGE,
-						CellRange::fromRepresentation(tokens[i+2].value).fromJust()
-					));
+				if(!function)return "Unknown function "+string(tokens[i].text);
+				const string_view arg=tokens[i+2].text;
+				const size_t colon=arg.find(':');
+				CellAddress from=readAddress(arg.substr(0,colon)),to=from;
+				if(colon!=string_view::npos){
+					to=readAddress(arg.substr(colon+1));
+					if(from.column>to.column)swap(from.column,to.column);
+					if(from.row>to.row)swap(from.row,to.row);
 				}
-				nodestack.push_back(node);
+				ins.op=OP_CALL;
+				ins.call=calls.size();
+				noperands++;
+				calls.push_back({
+					function,
+					{offset(from.row,anchor.row),offset(from.column,anchor.column)},
+					{offset(to.row,anchor.row),offset(to.column,anchor.column)}
+				});
 				i+=3;
-				prevWasOperator=false;
 				break;
-			case TT_SYMBOL:
-				if(tokens[i].value=="("){
-					opstack.push_back("(");
+			}
+			case TT_SYMBOL:{
+				const optype_t op=tokens[i].op;
+				if(op==OT_LPAREN){
+					opstack.push_back(OT_LPAREN);
 					prevWasOperator=true;
-				} else if(tokens[i].value=="-"&&prevWasOperator){
-					//unary minus
-					opstack.push_back("(-)");
+				} else if(op==OT_SUB&&prevWasOperator){
+					opstack.push_back(OT_NEG);
 					prevWasOperator=true; //technically unnecessary
 				} else {
-					const int prec=precedencemap[tokens[i].value];
-					const bool leftassoc=leftassocmap[tokens[i].value];
+					const int prec=precedence(op);
+					const bool leftassoc=leftAssociative(op);
 					while(opstack.size()){
-						const int otherprec=precedencemap[opstack.back()];
+						const int otherprec=precedence(opstack.back());
 						// both left-assoc: also pop equal-prec operators
 						// both right-assoc: only pop higher-prec operators
 						if(otherprec>prec||(leftassoc&&otherprec==prec)){
-							if((nodestack.size()<2&&opstack.back()!="(-)")||nodestack.size()<1){
-								for(ASTNode *node : nodestack)delete node;
-								return "Not enough arguments to operator "+
-								       opstack.back()+"?";
+							if(!compileOperator(opstack.back(),depth)){
+								return string("Not enough arguments to operator ")+
+								       operatorName(opstack.back())+"?";
 							}
-							node=new ASTNode(AN_OPERATOR,opstack.back());
-							if(opstack.back()!="(-)")node->children.push_back(nodestack[nodestack.size()-2]);
-							node->children.push_back(nodestack.back());
-							if(opstack.back()!="(-)")nodestack.pop_back();
-							nodestack.pop_back();
-							nodestack.push_back(node);
 							opstack.pop_back();
 						} else break;
 					}
-					if(tokens[i].value==")"){
+					if(op==OT_RPAREN){
 						if(opstack.size()==0){
-							for(ASTNode *node : nodestack)delete node;
 							return string("Excess closing parenthesis");
 						}
 						//because of their precedence, we can now assume
-						//that opstack.back()=="("
+						//that opstack.back()==OT_LPAREN
 						opstack.pop_back();
 						prevWasOperator=false;
 					} else {
-						opstack.push_back(tokens[i].value);
+						opstack.push_back(op);
 						prevWasOperator=true;
 					}
 				}
-				break;
+				continue;
+			}
 		}
+		code.push_back(ins);
+		maxdepth=max(maxdepth,++depth);
+		prevWasOperator=false;
 	}
 	while(opstack.size()){
-		if((nodestack.size()<2&&opstack.back()!="(-)")||nodestack.size()<1){
-			for(ASTNode *node : nodestack)delete node;
-			return "Not enough arguments to operator "+opstack.back()+"?";
+		if(!compileOperator(opstack.back(),depth)){
+			return string("Not enough arguments to operator ")+
+			       operatorName(opstack.back())+"?";
 		}
-		node=new ASTNode(AN_OPERATOR,opstack.back());
-		if(opstack.back()!="(-)")node->children.push_back(nodestack[nodestack.size()-2]);
-		node->children.push_back(nodestack.back());
-		if(opstack.back()!="(-)")nodestack.pop_back();
-		nodestack.pop_back();
-		nodestack.push_back(node);
 		opstack.pop_back();
 	}
-	if(nodestack.size()==1){
-		return nodestack.front();
+	if(depth!=1){
+		return to_string(depth)+" values?";
+	}
+	if(stringtoken!=-1){
+		if(code.size()>1){
+			for(Instruction &ins : code){
+				if(ins.op==OP_STRING)ins.op=OP_FAIL;
+			}
+		} else {
+			const string_view text=tokens[stringtoken].text;
+			for(size_t i=0;i<text.size();i++){
+				if(text[i]=='\\')i++;
+				strval+=text[i];
+			}
+		}
 	}
-	for(ASTNode *node : nodestack)delete node;
-	return to_string(nodestack.size())+" values?";
+	return Nothing();
 }
 
 
 
-Formula::Formula(ASTNode *root) noexcept
-	:root(root){}
-
-Formula::~Formula() noexcept {
-	delete root;
+CellAddress Formula::Address::resolve(CellAddress anchor) const noexcept {
+	return CellAddress(anchor.row+row,anchor.column+column);
 }
 
-Either<string,Formula*> Formula::parse(const string &s) noexcept {
-	Either<string,vector<Token>> mtokens=tokeniseFormula(s);
-	if(mtokens.isLeft())return mtokens.fromLeft();
-	Either<string,ASTNode*> mtree=parseExpression(mtokens.fromRight());
-	if(mtree.isLeft())return mtree.fromLeft();
-	return new Formula(mtree.fromRight());
+//Formulas by their text with the references relative to the anchor; entries
+//are removed when their formula is gone, in batches when the map has grown
+static mutex templatelock;
+static unordered_map<string,weak_ptr<const Formula>> templates;
+static size_t templatespurgesize=1024;
+
+//appends the decimal representation of v to s
+static void appendNumber(string &s,int v) noexcept {
+	char buf[16];
+	s.append(buf,to_chars(buf,buf+sizeof buf,v).ptr);
 }
 
-void Formula::collectDependencies(ASTNode *node,vector<CellAddress> &deps) const noexcept {
-	unsigned int x,y;
-	unsigned int fromx,fromy,tox,toy;
-	switch(node->type){
-		case AN_FUNCTION:
-		case AN_OPERATOR:
-			for(ASTNode *child : node->children){
-				collectDependencies(child,deps);
-			}
-			break;
-		case AN_ADDRESS:
-			deps.push_back(node->addrval);
-			break;
-		case AN_RANGE:
-			fromx=node->rangeval.from.column;
-			fromy=node->rangeval.from.row;
-			tox=node->rangeval.to.column;
-			toy=node->rangeval.to.row;
-			deps.reserve(deps.size()+(tox-fromx+1)*(toy-fromy+1));
-			for(y=fromy;y<=toy;y++){
-				for(x=fromx;x<=tox;x++){
-					deps.emplace_back(y,x);
-				}
-			}
-			break;
-		default:
-			break;
+Either<string,shared_ptr<const Formula>> Formula::parse(const string &s,
+                                                        CellAddress anchor) noexcept {
+	//reused between calls, so that parsing allocates little more than the
+	//Formula itself
+	thread_local vector<Token> tokens;
+	thread_local vector<string_view> segments;
+	thread_local vector<Address> refs;
+	thread_local string key;
+
+	Maybe<string> merr=tokeniseFormula(s,tokens);
+	if(merr.isJust())return move(merr).fromJust();
+
+	//split the text around the references
+	segments.clear();
+	refs.clear();
+	bool roundtrips=true;
+	size_t cursor=0;
+	for(const Token &token : tokens){
+		if(token.type!=TT_ADDRESS&&token.type!=TT_RANGE)continue;
+		const size_t colon=token.text.find(':');
+		const size_t nparts=colon==string_view::npos?1:2;
+		for(size_t i=0;i<nparts;i++){
+			const size_t start=i==0?0:colon+1;
+			const string_view part=token.text.substr(start,i==0?colon:string_view::npos);
+			const CellAddress addr=readAddress(part);
+			if(!addressRoundtrips(part))roundtrips=false;
+			segments.push_back(string_view(s).substr(cursor,token.pos+start-cursor));
+			refs.push_back({offset(addr.row,anchor.row),offset(addr.column,anchor.column)});
+			cursor=token.pos+start+part.size();
+		}
+	}
+	segments.push_back(string_view(s).substr(cursor));
+	if(!roundtrips){
+		//keep the text as is; the Formula can then only be used at anchor
+		segments.assign(1,s);
+		refs.clear();
+	}
+
+	key.clear();
+	for(size_t i=0;i<segments.size();i++){
+		appendNumber(key,segments[i].size());
+		key+='"';
+		key+=segments[i];
+		if(i<refs.size()){
+			appendNumber(key,refs[i].row);
+			key+=',';
+			appendNumber(key,refs[i].column);
+			key+=';';
+		}
 	}
+	if(!roundtrips)key+='@'+anchor.toRepresentation();
+	{
+		lock_guard<mutex> guard(templatelock);
+		auto it=templates.find(key);
+		if(it!=templates.end()){
+			shared_ptr<const Formula> formula=it->second.lock();
+			if(formula)return formula;
+		}
+	}
+
+	Formula *formula=new Formula;
+	Maybe<string> mcompileerr=formula->compile(tokens,anchor);
+	if(mcompileerr.isJust()){
+		delete formula;
+		return move(mcompileerr).fromJust();
+	}
+	formula->segments.assign(segments.begin(),segments.end());
+	formula->refs=refs;
+	shared_ptr<const Formula> shared(formula);
+
+	lock_guard<mutex> guard(templatelock);
+	templates[key]=shared;
+	if(templates.size()>=templatespurgesize){
+		for(auto it=templates.begin();it!=templates.end();){
+			if(it->second.expired())it=templates.erase(it);
+			else ++it;
+		}
+		templatespurgesize=max((size_t)1024,2*templates.size());
+	}
+	return shared;
 }
 
-vector<CellAddress> Formula::getDependencies() const noexcept {
-	vector<CellAddress> deps;
-	collectDependencies(root,deps);
+Dependencies Formula::getDependencies(CellAddress anchor) const noexcept {
+	Dependencies deps;
+	for(const Instruction &ins : code){
+		if(ins.op==OP_CELL)deps.cells.push_back(ins.address.resolve(anchor));
+	}
+	for(const Call &call : calls){
+		const CellAddress from=call.from.resolve(anchor),to=call.to.resolve(anchor);
+		if(from==to)deps.cells.push_back(from);
+		else deps.ranges.emplace_back(from,to);
+	}
 	return deps;
 }
 
+string Formula::getText(CellAddress anchor) const noexcept {
+	string text=segments[0];
+	for(size_t i=0;i<refs.size();i++){
+		text+=refs[i].resolve(anchor).toRepresentation();
+		text+=segments[i+1];
+	}
+	return text;
+}
+
+bool Formula::isNative() const noexcept {
+	return native.load(memory_order_relaxed)!=nullptr;
+}
+
 double modulo(double a,double b) noexcept {
 	b=abs(b);
 	return a<0?a+floor(-a/b)*b:a-floor(a/b)*b;
 }
 
-class Formula::Partialresult{
-	bool errflag=false;
-	bool numflag=false;
-
-	Partialresult(){}
+bool Formula::run(const CellArray &cells,CellAddress anchor,const double *callvalues,
+                  double &res) const noexcept {
+	jitfunc_t func=native.load(memory_order_acquire);
+	if(func)return runNative(func,cells,anchor,callvalues,res);
+	if(runs.fetch_add(1,memory_order_relaxed)+1==JIT_THRESHOLD)compileNative();
+	double localstack[16];
+	vector<double> heapstack;
+	double *sp=localstack; //points past the top of the stack
+	if(maxdepth>16){
+		heapstack.resize(maxdepth);
+		sp=heapstack.data();
+	}
+	for(const Instruction &ins : code){
+		switch(ins.op){
+			case OP_NUMBER:
+				*sp++=ins.number;
+				break;
+			case OP_CELL:{
+				//never-written cells are implicitly empty, with number 0
+				const CellAddress addr=ins.address.resolve(anchor);
+				const valuetype_t type=cells.numberAndType(addr,*sp++);
+				if(type!=VT_NUMBER&&type!=VT_EMPTY)return false;
+				break;
+			}
+			case OP_CALL:
+				*sp++=callvalues[ins.call];
+				break;
+			case OP_NEG: sp[-1]=-sp[-1]; break;
+			case OP_ADD: sp--; sp[-1]+=sp[0]; break;
+			case OP_SUB: sp--; sp[-1]-=sp[0]; break;
+			case OP_MUL: sp--; sp[-1]*=sp[0]; break;
+			case OP_DIV: sp--; sp[-1]/=sp[0]; break;
+			case OP_MOD: sp--; sp[-1]=modulo(sp[-1],sp[0]); break;
+			case OP_POW: sp--; sp[-1]=pow(sp[-1],sp[0]); break;
+			case OP_STRING:
+			case OP_FAIL:
+				return false;
+		}
+	}
+	res=sp[-1];
+	return true;
+}
 
-public:
-	double numval=0;
-	string strval;
+Formula::~Formula() noexcept {
+	JitBuilder::release(native.load(memory_order_relaxed));
+}
 
-	Partialresult(double numval):numflag(true),numval(numval){}
-	Partialresult(string strval):strval(strval){}
+void Formula::compileNative() const noexcept {
+	if(!JitBuilder::available()||code.size()<2||maxdepth>JitBuilder::MAXDEPTH)return;
+	JitBuilder builder;
+	vector<double> consts;
+	unsigned int depth=0,noperand=0;
+	for(const Instruction &ins : code){
+		switch(ins.op){
+			case OP_NUMBER:
+				builder.pushConstant(depth++,consts.size());
+				consts.push_back(ins.number);
+				break;
+			case OP_CELL:
+			case OP_CALL:
+				builder.pushOperand(depth++,noperand++);
+				break;
+			case OP_NEG: builder.negate(depth); break;
+			case OP_ADD: builder.arithmetic(depth--,'+'); break;
+			case OP_SUB: builder.arithmetic(depth--,'-'); break;
+			case OP_MUL: builder.arithmetic(depth--,'*'); break;
+			case OP_DIV: builder.arithmetic(depth--,'/'); break;
+			case OP_MOD: builder.call(depth--,modulo); break;
+			case OP_POW: builder.call(depth--,static_cast<double(*)(double,double)>(pow)); break;
+			case OP_STRING:
+			case OP_FAIL:
+				return; //always an error, leave that to run()
+		}
+	}
+	jitfunc_t func=builder.finish();
+	if(!func)return;
+	constants=move(consts);
+	native.store(func,memory_order_release);
+}
 
-	static Partialresult errorValue(){
-		Partialresult p;
-		p.errflag=true;
-		return p;
+bool Formula::runNative(jitfunc_t func,const CellArray &cells,CellAddress anchor,
+                        const double *callvalues,double &res) const noexcept {
+	double localoperands[16];
+	vector<double> heapoperands;
+	double *operands=localoperands;
+	if(noperands>16){
+		heapoperands.resize(noperands);
+		operands=heapoperands.data();
+	}
+	double *op=operands;
+	for(const Instruction &ins : code){
+		if(ins.op==OP_CELL){
+			const valuetype_t type=cells.numberAndType(ins.address.resolve(anchor),*op++);
+			if(type!=VT_NUMBER&&type!=VT_EMPTY)return false;
+		} else if(ins.op==OP_CALL){
+			*op++=callvalues[ins.call];
+		}
 	}
+	res=func(operands,constants.data());
+	return true;
+}
 
-	bool isNumber(){return numflag;}
-	bool isString(){return !numflag&&!errflag;}
-	bool isError(){return errflag;}
-};
+//the state of a call, aggregating its whole range
+static Formula::CallState aggregateRange(const CellArray &cells,bool counts,
+                                         CellRange range) noexcept {
+	if(counts)return {(double)cells.count(range),0};
+	Formula::CallState state;
+	state.total=cells.sum(range,&state.inexact);
+	return state;
+}
 
-Formula::Partialresult Formula::evaluateSubtree(ASTNode *node,
-                                                const CellArray &cells) const noexcept {
-	switch(node->type){
-		case AN_STRING:
-			return node->strval;
-		case AN_NUMBER:
-			return node->numval;
-		case AN_ADDRESS:
-			if(node->addrval.row>=cells.height()||
-			   node->addrval.column>=cells.width()){
-				return string(); //yet non-existent cells are empty
-			} else {
-				const Cell &cell=cells[node->addrval];
-				if(cell.isErrorValue()){
-					return Formula::Partialresult::errorValue();
-				}
-				string s=cell.getDisplayString();
-				if(s.size()==0)return 0;
-				Maybe<double> mv=convertstring<double>(s);
-				if(mv.isNothing())return s;
-				else return mv.fromJust();
-			}
-		case AN_RANGE:
-			//should not happen, since ranges are only parsed in function calls
-			return string("?range?");
-		case AN_FUNCTION:
-			if(node->children.size()!=1||
-			   (node->children[0]->type!=AN_ADDRESS&&
-			    node->children[0]->type!=AN_RANGE)){
-				//should not happen, since the parser enforces the
-				//function(addr/range) structure
-				return string("?functionarg?");
-			}
-			try {
-				if(node->children[0]->type==AN_ADDRESS){
-					return functionmap.at(node->strval)(
-						cells,
-						CellRange(node->children[0]->addrval,
-						          node->children[0]->addrval)
-					);
-				} else {
-					return functionmap.at(node->strval)(cells,node->children[0]->rangeval);
-				}
-			} catch(out_of_range){ //on the functionmap.at
-				//should not happen, again because of parser checks
-				return string("?function?");
-			}
-		case AN_OPERATOR:{
-			if(node->strval=="(-)"){
-				Formula::Partialresult arg=evaluateSubtree(node->children[0],cells);
-				if(!arg.isNumber())return Formula::Partialresult::errorValue();
-				return -arg.numval;
-			}
-			Formula::Partialresult arg1=evaluateSubtree(node->children[0],cells);
-			if(!arg1.isNumber())return Formula::Partialresult::errorValue();
-			Formula::Partialresult arg2=evaluateSubtree(node->children[1],cells);
-			if(!arg2.isNumber())return Formula::Partialresult::errorValue();
-			double argd[2]={arg1.numval,arg2.numval};
-			if(node->strval=="+")return argd[0]+argd[1];
-			else if(node->strval=="-")return argd[0]-argd[1];
-			else if(node->strval=="*")return argd[0]*argd[1];
-			else if(node->strval=="/")return argd[0]/argd[1];
-			else if(node->strval=="%")return modulo(argd[0],argd[1]);
-			else if(node->strval=="^")return pow(argd[0],argd[1]);
-			else return string("?operator?"); //again, should not happen etc.
+//Updates the state of a call by the changes within its range; returns false
+//if that can't be done exactly, and the range must be aggregated again.
+static bool applyChanges(const CellArray &cells,bool counts,CellRange range,
+                         const ChangeList &changes,Formula::CallState &state) noexcept {
+	if(!counts&&(state.inexact>0||
+	             (uint64_t)(range.to.row-range.from.row+1)*
+	             (range.to.column-range.from.column+1)>MAX_EXACT_TERMS)){
+		return false;
+	}
+	double total=state.total;
+	for(size_t i=0;i<changes.size;i++){
+		const ValueChange &change=changes.changes[i];
+		if(!range.contains(change.addr))continue;
+		double number;
+		const valuetype_t type=cells.numberAndType(change.addr,number);
+		if(counts){
+			total+=(double)(type!=VT_EMPTY)-(double)(change.oldtype!=VT_EMPTY);
+		} else {
+			if(!isExactInteger(number)||!isExactInteger(change.oldnumber))return false;
+			total+=number-change.oldnumber;
 		}
-		default:
-			return string("?nodetype?"); //shouldn't even think of it
 	}
+	state.total=total;
+	return true;
 }
 
-Maybe<string> Formula::evaluate(const CellArray &cells) const noexcept {
-	Formula::Partialresult res=evaluateSubtree(root,cells);
-	if(res.isError()){
-		return Nothing();
+valuetype_t Formula::evaluate(const CellArray &cells,CellAddress anchor,vector<CallState> &states,
+                              const ChangeList *changes,double &number,string &str) const noexcept {
+	if(code.size()==1){
+		//the only cases where the result can be a string
+		if(code[0].op==OP_STRING){
+			str=strval;
+			return VT_STRING;
+		}
+		if(code[0].op==OP_CELL){
+			const CellAddress addr=code[0].address.resolve(anchor);
+			if(cells.valueType(addr)==VT_STRING){
+				str=cells.stringValue(addr);
+				return VT_STRING;
+			}
+		}
+	}
+	const bool fresh=states.size()!=calls.size()||!changes||!changes->complete;
+	if(fresh)states.resize(calls.size());
+	double localvalues[8];
+	vector<double> heapvalues;
+	double *callvalues=localvalues;
+	if(calls.size()>8){
+		heapvalues.resize(calls.size());
+		callvalues=heapvalues.data();
 	}
-	if(res.isNumber()){
-		double v=res.numval;
-		if(std::isnan(v))return string("NaN");
-		if(v==0)return string("0"); //fix the -0 case
-		stringstream ss;
-		ss<<v;
-		return ss.str();
+	for(size_t i=0;i<calls.size();i++){
+		const Call &call=calls[i];
+		const CellRange range(call.from.resolve(anchor),call.to.resolve(anchor));
+		if(fresh||!applyChanges(cells,call.function->counts,range,*changes,states[i])){
+			states[i]=aggregateRange(cells,call.function->counts,range);
+		}
+		callvalues[i]=call.function->finish(states[i].total,range);
 	}
-	return res.strval;
+	double v;
+	if(!run(cells,anchor,callvalues,v))return VT_ERROR;
+	number=v==0?0:v; //fix the -0 case
+	return VT_NUMBER;
 }
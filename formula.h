@@ -1,72 +1,147 @@
 #pragma once
 
 #include "celladdress.h"
+#include "cell.h"
 #include "maybe.h"
 #include "either.h"
+#include "jit.h"
 #include <string>
+#include <string_view>
 #include <vector>
+#include <cstdint>
+#include <atomic>
+#include <memory>
 
 using namespace std;
 
 /*
 A wrapper for a formula, with useful functions for parsing and evaluating.
 Used extensively (obviously) by CellValueFormula.
+A parsed formula is compiled to bytecode for a small stack machine over
+doubles: numbers and cell addresses are stored inline in the instructions,
+and function calls refer to the resolved function and its range. Strings only
+occur as the complete formula, so they don't need a place on the stack.
+After JIT_THRESHOLD runs, a formula is also compiled to native code where that
+is supported (see JitBuilder); the values of its cells and function calls are
+then gathered beforehand, so the native code only does arithmetic. Formulas
+with string or error operands take the bytecode path.
+The functions aggregate a range; the aggregates are kept per cell, so that a
+change of a few cells in a long range doesn't need a pass over the range.
+Formulas are parsed for a particular cell, the anchor, and all cell references
+are stored relative to it. Formulas with the same text up to those relative
+references, like a formula filled down a column, share a single Formula
+object; every function taking an anchor must get the cell that the formula
+belongs to. The edit string is reconstructed from the text around the
+references, so it round-trips exactly.
+Parsing works on views into the formula text and emits the bytecode directly,
+without a parse tree, so it doesn't allocate per token.
 */
 
 class CellArray;
+struct ChangeList;
 
 class Formula{
-	enum astnodetype_t{
-		AN_FUNCTION,
-		AN_STRING,
-		AN_NUMBER,
-		AN_ADDRESS,
-		AN_RANGE,
-		AN_OPERATOR
+	class Token;
+	struct Function;
+	static const Function functions[]; //by name, for the parser
+
+	enum opcode_t : uint8_t{
+		OP_NUMBER, //push number
+		OP_CELL, //push the value of address; fails if not a number
+		OP_CALL, //push the result of calls[call]
+		OP_STRING, //the formula is the string literal strval
+		OP_FAIL, //fail; used for strings in arithmetic
+		OP_NEG,
+		OP_ADD,
+		OP_SUB,
+		OP_MUL,
+		OP_DIV,
+		OP_MOD,
+		OP_POW
 	};
 
-	class ASTNode{
-	public:
-		astnodetype_t type;
-		const double numval=0;
-		const string strval;
-		const CellAddress addrval=CellAddress(0,0);
-		const CellRange rangeval=CellRange(CellAddress(0,0),CellAddress(0,0));
-		vector<ASTNode*> children;
-
-		ASTNode(astnodetype_t type,double numval) noexcept;
-		ASTNode(astnodetype_t type,string strval) noexcept;
-		ASTNode(astnodetype_t type,CellAddress addrval) noexcept;
-		ASTNode(astnodetype_t type,CellRange rangeval) noexcept;
-
-		~ASTNode() noexcept;
+	struct Address{ //offset from the anchor
+		int row,column;
+
+		CellAddress resolve(CellAddress anchor) const noexcept;
 	};
 
-	class Token;
-	class Partialresult;
+	struct Instruction{
+		opcode_t op;
+		union{
+			double number;
+			Address address;
+			unsigned int call;
+		};
+	};
+
+	struct Call{
+		const Function *function;
+		Address from,to;
+	};
 
+	//the formula text is segments[0] refs[0] segments[1] ... segments.back()
+	vector<string> segments;
+	vector<Address> refs;
 
-	ASTNode *root;
+	vector<Instruction> code;
+	vector<Call> calls;
+	string strval;
+	unsigned int maxdepth=0; //maximum stack size needed to run code
 
-	Formula(ASTNode *root) noexcept;
+	static const unsigned int JIT_THRESHOLD=64;
+	mutable atomic<unsigned int> runs{0};
+	mutable atomic<jitfunc_t> native{nullptr};
+	mutable vector<double> constants; //for native; set before native is
+	unsigned int noperands=0; //number of cells and calls in code
 
-	//Parsing and tokenisation sub functions
-	static Maybe<Token> tryTokeniseNameAddressRange(const string &formula,int &cursor) noexcept;
-	static Either<string,vector<Token>> tokeniseFormula(const string &formula) noexcept;
-	static Either<string,ASTNode*> parseExpression(const vector<Token> &tokens) noexcept;
+	Formula() noexcept=default;
 
-	//evaluation and dep getting sub functions
-	void collectDependencies(ASTNode *node,vector<CellAddress> &deps) const noexcept;
-	Partialresult evaluateSubtree(ASTNode *node,const CellArray &cells) const noexcept;
+	//Parsing and tokenisation sub functions; these return an error message
+	static Maybe<string> tokeniseFormula(const string &formula,vector<Token> &tokens) noexcept;
+	Maybe<string> compile(const vector<Token> &tokens,CellAddress anchor) noexcept;
+	bool compileOperator(int op,unsigned int &depth) noexcept;
+
+	//runs the code with the given results of the calls, putting the result
+	//in res; returns false if an error in dependencies
+	bool run(const CellArray &cells,CellAddress anchor,const double *callvalues,
+	         double &res) const noexcept;
+
+	//sets native, if the formula can be compiled
+	void compileNative() const noexcept;
+	//like run(), using native
+	bool runNative(jitfunc_t func,const CellArray &cells,CellAddress anchor,
+	               const double *callvalues,double &res) const noexcept;
 
 public:
-	~Formula() noexcept;
+	~Formula() noexcept; //releases the native code, if any
+
+	//The state of a function call of a formula in one cell: the aggregate of
+	//its range, kept between evaluations by the cell
+	struct CallState{
+		double total;
+		size_t inexact; //numbers in the range that aren't exact integers
+	};
+
+	//Maybe construct a Formula for the cell at anchor, from its text without
+	//the '='; may return a Formula shared with other cells
+	static Either<string,shared_ptr<const Formula>> parse(const string &s,
+	                                                     CellAddress anchor) noexcept;
+
+	Dependencies getDependencies(CellAddress anchor) const noexcept;
 
-	//Maybe construct a Formla
-	static Either<string,Formula*> parse(const string &s) noexcept;
+	//the text the formula was parsed from, at anchor
+	string getText(CellAddress anchor) const noexcept;
 
-	vector<CellAddress> getDependencies() const noexcept;
+	//whether the formula is run as native code by now
+	bool isNative() const noexcept;
 
-	//returns Nothing if an error in dependencies
-	Maybe<string> evaluate(const CellArray &cells) const noexcept;
+	//Returns the type of the result, VT_NUMBER (in number) or VT_STRING (in
+	//str), or VT_ERROR if an error in dependencies; only reads cells, so may
+	//be called concurrently. states are the CallState's of the cell; if
+	//changes is complete, calls whose ranges contain only exact integers are
+	//updated by the differences of the changed cells, instead of aggregating
+	//their whole range again.
+	valuetype_t evaluate(const CellArray &cells,CellAddress anchor,vector<CallState> &states,
+	                     const ChangeList *changes,double &number,string &str) const noexcept;
 };
@@ -0,0 +1,192 @@
+#include "jit.h"
+#include <mutex>
+#include <cstring>
+
+#if defined(__x86_64__)&&defined(__linux__)
+#define JIT_SUPPORTED 1
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+//registers in ModRM numbering
+enum{
+	REG_RSP=4,
+	REG_RBX=3,
+	REG_R13=13
+};
+
+//bytes of stack used to keep xmm registers across calls
+static const int32_t SPILLSIZE=8*JitBuilder::MAXDEPTH;
+
+#ifdef JIT_SUPPORTED
+
+static const size_t CHUNKSIZE=1<<16;
+
+//A chunk of executable memory, which code is appended to
+struct ExecChunk{
+	uint8_t *write;
+	const uint8_t *exec;
+	size_t used;
+	size_t live; //functions in it that weren't released yet
+};
+
+static mutex chunklock;
+//the last one is the current chunk; the others are unmapped once they have
+//no live functions left
+static vector<ExecChunk> chunks;
+static bool failed=false; //no more executable memory to be had
+
+static bool newChunk(){
+	int fd=memfd_create("formula-jit",MFD_CLOEXEC);
+	if(fd==-1)return false;
+	if(ftruncate(fd,CHUNKSIZE)==-1){
+		close(fd);
+		return false;
+	}
+	void *write=mmap(nullptr,CHUNKSIZE,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	void *exec=mmap(nullptr,CHUNKSIZE,PROT_READ|PROT_EXEC,MAP_SHARED,fd,0);
+	close(fd);
+	if(write==MAP_FAILED||exec==MAP_FAILED){
+		if(write!=MAP_FAILED)munmap(write,CHUNKSIZE);
+		if(exec!=MAP_FAILED)munmap(exec,CHUNKSIZE);
+		return false;
+	}
+	chunks.push_back({(uint8_t*)write,(const uint8_t*)exec,0,0});
+	return true;
+}
+
+static const void* install(const vector<uint8_t> &code){
+	if(code.size()>CHUNKSIZE)return nullptr;
+	lock_guard<mutex> guard(chunklock);
+	if(failed)return nullptr;
+	if((chunks.empty()||chunks.back().used+code.size()>CHUNKSIZE)&&!newChunk()){
+		failed=true;
+		return nullptr;
+	}
+	ExecChunk &chunk=chunks.back();
+	memcpy(chunk.write+chunk.used,code.data(),code.size());
+	const void *func=chunk.exec+chunk.used;
+	chunk.used=(chunk.used+code.size()+15)&~(size_t)15;
+	chunk.live++;
+	return func;
+}
+
+void JitBuilder::release(jitfunc_t func) noexcept {
+	if(!func)return;
+	const uint8_t *p=(const uint8_t*)func;
+	lock_guard<mutex> guard(chunklock);
+	for(size_t i=0;i<chunks.size();i++){
+		ExecChunk &chunk=chunks[i];
+		if(p<chunk.exec||p>=chunk.exec+CHUNKSIZE)continue;
+		if(--chunk.live>0)return;
+		if(i==chunks.size()-1){
+			chunk.used=0; //start over in the current chunk
+			return;
+		}
+		munmap(chunk.write,CHUNKSIZE);
+		munmap((void*)chunk.exec,CHUNKSIZE);
+		chunks.erase(chunks.begin()+i);
+		return;
+	}
+}
+
+bool JitBuilder::available() noexcept {
+	return true;
+}
+
+#else
+
+bool JitBuilder::available() noexcept {
+	return false;
+}
+
+void JitBuilder::release(jitfunc_t) noexcept {}
+
+#endif
+
+void JitBuilder::emit(initializer_list<uint8_t> bytes){
+	code.insert(code.end(),bytes);
+}
+
+void JitBuilder::emit32(uint32_t v){
+	for(int i=0;i<4;i++)code.push_back(v>>(8*i));
+}
+
+void JitBuilder::emit64(uint64_t v){
+	for(int i=0;i<8;i++)code.push_back(v>>(8*i));
+}
+
+void JitBuilder::sseRegReg(uint8_t prefix,uint8_t opcode,unsigned int dst,unsigned int src){
+	code.push_back(prefix);
+	if(dst>=8||src>=8)code.push_back(0x40|(dst>=8)<<2|(src>=8));
+	emit({0x0F,opcode,(uint8_t)(0xC0|(dst&7)<<3|(src&7))});
+}
+
+void JitBuilder::sseRegMem(uint8_t prefix,uint8_t opcode,unsigned int reg,unsigned int base,int32_t disp){
+	code.push_back(prefix);
+	if(reg>=8||base>=8)code.push_back(0x40|(reg>=8)<<2|(base>=8));
+	emit({0x0F,opcode,(uint8_t)(0x80|(reg&7)<<3|(base&7))});
+	if((base&7)==REG_RSP)code.push_back(0x24); //SIB for [rsp+disp32]
+	emit32(disp);
+}
+
+JitBuilder::JitBuilder(){
+	//keep the arguments in callee-saved registers, so that they survive
+	//calls; the spill area keeps the stack 16-byte aligned at calls
+	emit({0x53}); //push rbx
+	emit({0x41,0x55}); //push r13
+	emit({0x48,0x81,0xEC}); emit32(SPILLSIZE); //sub rsp,SPILLSIZE
+	emit({0x48,0x89,0xFB}); //mov rbx,rdi
+	emit({0x49,0x89,0xF5}); //mov r13,rsi
+}
+
+void JitBuilder::pushOperand(unsigned int depth,unsigned int index){
+	sseRegMem(0xF2,0x10,depth,REG_RBX,8*index); //movsd xmm,[rbx+8*index]
+}
+
+void JitBuilder::pushConstant(unsigned int depth,unsigned int index){
+	sseRegMem(0xF2,0x10,depth,REG_R13,8*index); //movsd xmm,[r13+8*index]
+}
+
+void JitBuilder::negate(unsigned int depth){
+	emit({0x48,0xB8}); emit64(0x8000000000000000ULL); //mov rax,signbit
+	emit({0x66,0x4C,0x0F,0x6E,0xF8}); //movq xmm15,rax
+	sseRegReg(0x66,0x57,depth-1,15); //xorpd
+}
+
+void JitBuilder::arithmetic(unsigned int depth,char op){
+	uint8_t opcode;
+	switch(op){
+		case '+': opcode=0x58; break; //addsd
+		case '-': opcode=0x5C; break; //subsd
+		case '*': opcode=0x59; break; //mulsd
+		default: opcode=0x5E; break; //divsd
+	}
+	sseRegReg(0xF2,opcode,depth-2,depth-1);
+}
+
+void JitBuilder::call(unsigned int depth,double (*f)(double,double)){
+	//all xmm registers are caller-saved, so spill the ones below the arguments
+	const unsigned int a=depth-2,b=depth-1;
+	for(unsigned int i=0;i<a;i++)sseRegMem(0xF2,0x11,i,REG_RSP,8*i); //movsd [rsp+8i],xmm
+	if(a!=0)sseRegReg(0x66,0x28,0,a); //movapd xmm0,xmm_a
+	if(b!=1)sseRegReg(0x66,0x28,1,b); //movapd xmm1,xmm_b
+	emit({0x48,0xB8}); emit64((uint64_t)f); //mov rax,f
+	emit({0xFF,0xD0}); //call rax
+	if(a!=0)sseRegReg(0x66,0x28,a,0); //movapd xmm_a,xmm0
+	for(unsigned int i=0;i<a;i++)sseRegMem(0xF2,0x10,i,REG_RSP,8*i);
+}
+
+jitfunc_t JitBuilder::finish(){
+#ifdef JIT_SUPPORTED
+	emit({0x48,0x81,0xC4}); emit32(SPILLSIZE); //add rsp,SPILLSIZE
+	emit({0x41,0x5D}); //pop r13
+	emit({0x5B}); //pop rbx
+	emit({0xC3}); //ret
+	return (jitfunc_t)install(code);
+#else
+	return nullptr;
+#endif
+}
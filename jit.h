@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+/*
+A tiny x86-64 code generator for the numeric part of formulas, used by Formula
+to compile hot formulas to native code. The generated functions get an array
+of operand values (the values of the cells and function calls in the formula,
+gathered by the caller) and an array of constants. The evaluation stack lives
+in the SSE registers xmm0-xmm14, so at most MAXDEPTH values can be on it;
+xmm15 is scratch.
+The code is written through a writable mapping of a memory file, and executed
+through a separate read+execute mapping of the same file, so no page is ever
+both writable and executable. Compiled code is freed with release(); the
+memory is allocated in chunks, which are unmapped once all code in them is.
+On other platforms, or if executable memory can't be had, available() is false
+and finish() returns nullptr.
+*/
+
+typedef double (*jitfunc_t)(const double *operands,const double *constants);
+
+class JitBuilder{
+	vector<uint8_t> code;
+
+	void emit(initializer_list<uint8_t> bytes);
+	void emit32(uint32_t v);
+	void emit64(uint64_t v);
+	//SSE instruction with prefix, opcode and a register-register ModRM
+	void sseRegReg(uint8_t prefix,uint8_t opcode,unsigned int dst,unsigned int src);
+	//SSE instruction with a [base+disp32] memory operand
+	void sseRegMem(uint8_t prefix,uint8_t opcode,unsigned int reg,unsigned int base,int32_t disp);
+
+public:
+	static const unsigned int MAXDEPTH=15;
+
+	static bool available() noexcept;
+
+	JitBuilder(); //emits the prologue
+
+	//The depth arguments are the stack height before the operation.
+	void pushOperand(unsigned int depth,unsigned int index); //operands[index]
+	void pushConstant(unsigned int depth,unsigned int index); //constants[index]
+	void negate(unsigned int depth);
+	void arithmetic(unsigned int depth,char op); //op in "+-*/"
+	void call(unsigned int depth,double (*f)(double,double)); //f(a,b)
+
+	//emits the epilogue, returning the top of the stack, and installs the
+	//code in executable memory
+	jitfunc_t finish();
+
+	//frees code returned by finish(), which mustn't be run anymore; nullptr
+	//is ignored
+	static void release(jitfunc_t func) noexcept;
+};
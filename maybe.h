@@ -2,6 +2,7 @@
 
 #include <cstddef>
 #include <utility> //for move()
+#include <new> //for placement new
 
 using namespace std;
 
@@ -9,25 +10,37 @@ using namespace std;
 Either a value of some type, or nothing. This could have been implemented
 as, and is functionally equivalent to, Either<Nothing,T>, but a separate
 class arguably enables the use of much better method names.
+The value is stored inside the Maybe itself, so making one doesn't allocate;
+the accessors on a temporary Maybe move the value out instead of copying it.
 */
 
 struct Nothing{}; //special empty value for use with Maybe
 
 template <typename T>
 class Maybe{
-	const T *val;
+	union{
+		T val;
+	};
+	bool just;
 
 public:
 	Maybe(T value) noexcept; //constructs a Just(v)
 	Maybe(Nothing) noexcept; //constructs an empty Maybe
 
+	Maybe(const Maybe &other) noexcept;
+	Maybe(Maybe &&other) noexcept;
+	Maybe& operator=(const Maybe &other) noexcept;
+	Maybe& operator=(Maybe &&other) noexcept;
+
 	~Maybe() noexcept;
 
 	//gets the Just-value, assuming it isn't Nothing
-	T fromJust() const noexcept;
+	const T& fromJust() const & noexcept;
+	T fromJust() && noexcept;
 
 	//gets the Just-value if present, or a copy of `def` if it's Nothing
-	T fromMaybe(T &def) const noexcept;
+	T fromMaybe(T &def) const & noexcept;
+	T fromMaybe(T &def) && noexcept;
 
 	bool isJust() const noexcept; //query whether this is a Just-value
 	bool isNothing() const noexcept; //query whether this is Nothing (==!isJust())
@@ -35,34 +48,74 @@ public:
 
 template <typename T>
 Maybe<T>::Maybe(T value) noexcept
-	:val(new T(move(value))){}
+	:val(move(value)),just(true){}
 
 template <typename T>
 Maybe<T>::Maybe(Nothing) noexcept
-	:val(nullptr){}
+	:just(false){}
+
+template <typename T>
+Maybe<T>::Maybe(const Maybe &other) noexcept
+		:just(other.just){
+	if(just)new(&val) T(other.val);
+}
+
+template <typename T>
+Maybe<T>::Maybe(Maybe &&other) noexcept
+		:just(other.just){
+	if(just)new(&val) T(move(other.val));
+}
+
+template <typename T>
+Maybe<T>& Maybe<T>::operator=(const Maybe &other) noexcept {
+	if(this!=&other){
+		this->~Maybe();
+		new(this) Maybe(other);
+	}
+	return *this;
+}
+
+template <typename T>
+Maybe<T>& Maybe<T>::operator=(Maybe &&other) noexcept {
+	if(this!=&other){
+		this->~Maybe();
+		new(this) Maybe(move(other));
+	}
+	return *this;
+}
 
 template <typename T>
 Maybe<T>::~Maybe() noexcept {
-	if(val)delete val;
+	if(just)val.~T();
 }
 
 
 template <typename T>
-T Maybe<T>::fromJust() const noexcept {
-	return *val;
+const T& Maybe<T>::fromJust() const & noexcept {
+	return val;
+}
+
+template <typename T>
+T Maybe<T>::fromJust() && noexcept {
+	return move(val);
+}
+
+template <typename T>
+T Maybe<T>::fromMaybe(T &def) const & noexcept {
+	return just?val:def;
 }
 
 template <typename T>
-T Maybe<T>::fromMaybe(T &def) const noexcept {
-	return val?*val:def;
+T Maybe<T>::fromMaybe(T &def) && noexcept {
+	return just?move(val):def;
 }
 
 template <typename T>
 bool Maybe<T>::isJust() const noexcept {
-	return (bool)val;
+	return just;
 }
 
 template <typename T>
 bool Maybe<T>::isNothing() const noexcept {
-	return !val;
+	return !just;
 }
@@ -0,0 +1,56 @@
+#include "numberformat.h"
+#include <charconv>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+size_t formatNumber(double v,char *buf) noexcept {
+	if(std::isnan(v)){
+		memcpy(buf,"NaN",3);
+		return 3;
+	}
+	return to_chars(buf,buf+NUMBER_BUFSIZE,v).ptr-buf;
+}
+
+size_t formatNumber(int v,char *buf) noexcept {
+	return to_chars(buf,buf+NUMBER_BUFSIZE,v).ptr-buf;
+}
+
+size_t formatFixed(double v,int decimals,char *buf) noexcept {
+	if(!std::isfinite(v))return formatNumber(v,buf);
+	const to_chars_result res=to_chars(buf,buf+NUMBER_BUFSIZE,v,chars_format::fixed,decimals);
+	if(res.ec!=errc())return formatNumber(v,buf);
+	return res.ptr-buf;
+}
+
+size_t formatFitted(double v,size_t width,char *buf) noexcept {
+	size_t len=formatNumber(v,buf);
+	if(len<=width)return len;
+	//fixed notation, with as many decimals as fit, unless that leaves no
+	//significant digits
+	if(std::isfinite(v)&&fabs(v)>=1e-4&&fabs(v)<1e15){
+		for(int decimals=(int)width-1;decimals>=0;decimals--){
+			len=formatFixed(v,decimals,buf);
+			if(decimals>0){
+				while(buf[len-1]=='0')len--;
+				if(buf[len-1]=='.')len--;
+			}
+			if(len<=width){
+				if(find_if(buf,buf+len,[](char c){return c>='1'&&c<='9';})!=buf+len)return len;
+				break;
+			}
+		}
+	}
+	//scientific notation, with as many digits as fit
+	if(std::isfinite(v)){
+		for(int precision=(int)width;precision>=0;precision--){
+			const to_chars_result res=
+				to_chars(buf,buf+NUMBER_BUFSIZE,v,chars_format::scientific,precision);
+			if(res.ec==errc()&&(size_t)(res.ptr-buf)<=width)return res.ptr-buf;
+		}
+	}
+	memset(buf,'#',width);
+	return width;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+
+using namespace std;
+
+/*
+Formatting of numbers for display, into a buffer of the caller of at least
+NUMBER_BUFSIZE characters, so that it doesn't allocate. The default format is
+the shortest string that reads back as exactly the same double, so that edit
+strings of numbers lose nothing; NaN is shown as "NaN". The other formats are
+for showing a number in a limited width, like a column of the view.
+The functions return the length of the string, which isn't terminated.
+*/
+
+const size_t NUMBER_BUFSIZE=64;
+
+//the shortest representation that round-trips
+size_t formatNumber(double v,char *buf) noexcept;
+size_t formatNumber(int v,char *buf) noexcept;
+
+//with exactly decimals digits after the point (and no point for 0); numbers
+//too large for that are formatted with formatNumber
+size_t formatFixed(double v,int decimals,char *buf) noexcept;
+
+//the most precise representation of at most width characters, rounding
+//decimals or switching to scientific notation where needed; if nothing fits,
+//width '#'s
+size_t formatFitted(double v,size_t width,char *buf) noexcept;
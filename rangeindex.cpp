@@ -0,0 +1,138 @@
+#include "rangeindex.h"
+#include <algorithm>
+
+using namespace std;
+
+RangeIndex::Node::Node(CellRange range,CellAddress dest,uint32_t priority) noexcept
+	:range(range),dest(dest),priority(priority),left(-1),right(-1),
+	 maxrow(range.to.row),mincolumn(range.from.column),maxcolumn(range.to.column){}
+
+uint32_t RangeIndex::nextPriority() noexcept {
+	//xorshift32; only needs to be random enough to keep the treap balanced
+	seed^=seed<<13;
+	seed^=seed>>17;
+	seed^=seed<<5;
+	return seed;
+}
+
+void RangeIndex::recompute(int n) noexcept {
+	Node &node=nodes[n];
+	node.maxrow=node.range.to.row;
+	node.mincolumn=node.range.from.column;
+	node.maxcolumn=node.range.to.column;
+	for(int child : {node.left,node.right}){
+		if(child<0)continue;
+		node.maxrow=max(node.maxrow,nodes[child].maxrow);
+		node.mincolumn=min(node.mincolumn,nodes[child].mincolumn);
+		node.maxcolumn=max(node.maxcolumn,nodes[child].maxcolumn);
+	}
+}
+
+bool RangeIndex::keyLess(const Node &a,const Node &b) noexcept {
+	const unsigned int ka[6]={a.range.from.row,a.range.from.column,
+	                          a.range.to.row,a.range.to.column,
+	                          a.dest.row,a.dest.column};
+	const unsigned int kb[6]={b.range.from.row,b.range.from.column,
+	                          b.range.to.row,b.range.to.column,
+	                          b.dest.row,b.dest.column};
+	return lexicographical_compare(ka,ka+6,kb,kb+6);
+}
+
+bool RangeIndex::keyEqual(const Node &a,CellRange range,CellAddress dest) noexcept {
+	return a.range==range&&a.dest==dest;
+}
+
+void RangeIndex::split(int n,const Node &k,int &left,int &right) noexcept {
+	if(n<0){
+		left=right=-1;
+		return;
+	}
+	int l,r;
+	if(keyLess(nodes[n],k)){
+		split(nodes[n].right,k,l,r);
+		nodes[n].right=l;
+		left=n;
+		right=r;
+	} else {
+		split(nodes[n].left,k,l,r);
+		nodes[n].left=r;
+		left=l;
+		right=n;
+	}
+	recompute(n);
+}
+
+int RangeIndex::merge(int left,int right) noexcept {
+	if(left<0)return right;
+	if(right<0)return left;
+	if(nodes[left].priority>nodes[right].priority){
+		nodes[left].right=merge(nodes[left].right,right);
+		recompute(left);
+		return left;
+	} else {
+		nodes[right].left=merge(left,nodes[right].left);
+		recompute(right);
+		return right;
+	}
+}
+
+void RangeIndex::insert(CellRange range,CellAddress dest){
+	int n;
+	if(freelist.size()){
+		n=freelist.back();
+		freelist.pop_back();
+		nodes[n]=Node(range,dest,nextPriority());
+	} else {
+		n=nodes.size();
+		nodes.emplace_back(range,dest,nextPriority());
+	}
+	int left,right;
+	split(root,nodes[n],left,right);
+	root=merge(merge(left,n),right);
+}
+
+int RangeIndex::erase(int n,CellRange range,CellAddress dest,bool &found) noexcept {
+	if(n<0)return n;
+	if(keyEqual(nodes[n],range,dest)){
+		found=true;
+		freelist.push_back(n);
+		return merge(nodes[n].left,nodes[n].right);
+	}
+	const Node k(range,dest,0);
+	if(keyLess(k,nodes[n])){
+		nodes[n].left=erase(nodes[n].left,range,dest,found);
+	} else {
+		nodes[n].right=erase(nodes[n].right,range,dest,found);
+	}
+	recompute(n);
+	return n;
+}
+
+bool RangeIndex::erase(CellRange range,CellAddress dest) noexcept {
+	bool found=false;
+	root=erase(root,range,dest,found);
+	return found;
+}
+
+void RangeIndex::query(int n,CellAddress addr,vector<CellAddress> &out) const {
+	if(n<0)return;
+	const Node &node=nodes[n];
+	if(node.maxrow<addr.row||
+	   node.mincolumn>addr.column||
+	   node.maxcolumn<addr.column){
+		return;
+	}
+	query(node.left,addr,out);
+	//this node and its right subtree all start below addr
+	if(node.range.from.row>addr.row)return;
+	if(node.range.contains(addr))out.push_back(node.dest);
+	query(node.right,addr,out);
+}
+
+void RangeIndex::query(CellAddress addr,vector<CellAddress> &out) const {
+	query(root,addr,out);
+}
+
+size_t RangeIndex::size() const noexcept {
+	return nodes.size()-freelist.size();
+}
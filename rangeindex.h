@@ -0,0 +1,62 @@
+#pragma once
+
+#include "celladdress.h"
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+/*
+A spatial index of range dependencies: entries are pairs of a range and the
+cell that depends on it, and the index can be queried for all dependents whose
+range contains a given cell. A formula depending on a range thus costs one
+entry, regardless of the area of the range.
+
+This is an interval tree on the rows of the ranges, implemented as a treap
+ordered on the first row of each range. Every node is augmented with the
+bounding box of its subtree (last row, first and last column), which allows a
+query to skip subtrees that can't contain the queried cell.
+Nodes are kept in a vector and linked by index; erased nodes are reused.
+*/
+
+class RangeIndex{
+	struct Node{
+		CellRange range;
+		CellAddress dest;
+		uint32_t priority;
+		int left,right; //-1 if absent
+		//bounding box of the subtree rooted here
+		unsigned int maxrow,mincolumn,maxcolumn;
+
+		Node(CellRange range,CellAddress dest,uint32_t priority) noexcept;
+	};
+
+	vector<Node> nodes;
+	vector<int> freelist;
+	int root=-1;
+	uint32_t seed=0x9e3779b9;
+
+	uint32_t nextPriority() noexcept;
+	void recompute(int n) noexcept;
+	static bool keyLess(const Node &a,const Node &b) noexcept;
+	static bool keyEqual(const Node &a,CellRange range,CellAddress dest) noexcept;
+
+	//splits the subtree n in nodes with key less than that of node k, and the
+	//rest
+	void split(int n,const Node &k,int &left,int &right) noexcept;
+	int merge(int left,int right) noexcept;
+	int erase(int n,CellRange range,CellAddress dest,bool &found) noexcept;
+	void query(int n,CellAddress addr,vector<CellAddress> &out) const;
+
+public:
+	//adds an entry; duplicate entries are kept separately
+	void insert(CellRange range,CellAddress dest);
+
+	//removes one matching entry; returns false if none was present
+	bool erase(CellRange range,CellAddress dest) noexcept;
+
+	//appends the dest of every entry whose range contains addr to out
+	void query(CellAddress addr,vector<CellAddress> &out) const;
+
+	size_t size() const noexcept;
+};
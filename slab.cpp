@@ -0,0 +1,44 @@
+#include "slab.h"
+#include <cstdlib>
+#include <cstdint>
+
+using namespace std;
+
+//the first ALIGN bytes of a chunk hold its size class
+static size_t& chunkClass(void *chunk) noexcept {
+	return *(size_t*)chunk;
+}
+
+Slab::~Slab() noexcept {
+	for(void *chunk : chunks)free(chunk);
+}
+
+void* Slab::allocate(size_t size){
+	const size_t cls=size?(size-1)/ALIGN:0;
+	const size_t objsize=(cls+1)*ALIGN;
+	lock_guard<mutex> guard(lock);
+	if(FreeObject *obj=freelists[cls]){
+		freelists[cls]=obj->next;
+		return obj;
+	}
+	if(bumpend[cls]-bump[cls]<(ptrdiff_t)objsize){
+		void *chunk=aligned_alloc(CHUNK_SIZE,CHUNK_SIZE);
+		if(!chunk)throw bad_alloc();
+		chunks.push_back(chunk);
+		chunkClass(chunk)=cls;
+		bump[cls]=(char*)chunk+ALIGN;
+		bumpend[cls]=(char*)chunk+CHUNK_SIZE;
+	}
+	void *obj=bump[cls];
+	bump[cls]+=objsize;
+	return obj;
+}
+
+void Slab::deallocate(void *p) noexcept {
+	void *chunk=(void*)((uintptr_t)p&~(uintptr_t)(CHUNK_SIZE-1));
+	FreeObject *obj=(FreeObject*)p;
+	lock_guard<mutex> guard(lock);
+	const size_t cls=chunkClass(chunk);
+	obj->next=freelists[cls];
+	freelists[cls]=obj;
+}
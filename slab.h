@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <cstddef>
+
+using namespace std;
+
+/*
+An allocator for many small objects of a few different sizes, like the
+out-of-line cell values of a sheet. Memory is taken in aligned chunks of
+CHUNK_SIZE bytes that each serve one size class (a multiple of ALIGN), so that
+the class of an object can be found from its address alone; freed objects are
+reused by later allocations of the same class. The chunks are only returned
+when the Slab is destroyed, all at once, but the destructors of the objects in
+it must have been run by then.
+Allocation is thread-safe, since cells may be regenerated during a parallel
+recalculation.
+*/
+
+class Slab{
+public:
+	static const size_t ALIGN=16;
+	static const size_t MAX_SIZE=256;
+
+private:
+	static const size_t CHUNK_SIZE=1<<16;
+	static const size_t NCLASSES=MAX_SIZE/ALIGN;
+
+	struct FreeObject{
+		FreeObject *next;
+	};
+
+	vector<void*> chunks;
+	FreeObject *freelists[NCLASSES]={};
+	char *bump[NCLASSES]={}; //the unused part of the last chunk of each class
+	char *bumpend[NCLASSES]={};
+	mutex lock;
+
+public:
+	Slab() noexcept=default;
+	Slab(const Slab&)=delete;
+	Slab& operator=(const Slab&)=delete;
+	~Slab() noexcept;
+
+	//size must be at most MAX_SIZE
+	void* allocate(size_t size);
+	//p must have been returned by allocate() of this Slab
+	void deallocate(void *p) noexcept;
+
+	//allocates and constructs a T
+	template <typename T,typename... Args>
+	T* make(Args&&... args);
+	//destructs and deallocates an object from make()
+	template <typename T>
+	void destroy(T *p) noexcept;
+};
+
+template <typename T,typename... Args>
+T* Slab::make(Args&&... args){
+	static_assert(sizeof(T)<=MAX_SIZE&&alignof(T)<=ALIGN,"Type too large for a Slab");
+	return new(allocate(sizeof(T))) T(forward<Args>(args)...);
+}
+
+template <typename T>
+void Slab::destroy(T *p) noexcept {
+	if(!p)return;
+	p->~T();
+	deallocate(p);
+}
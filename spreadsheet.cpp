@@ -1,62 +1,441 @@
 #include "cell.h"
 #include "spreadsheet.h"
 #include "util.h"
+#include "threadpool.h"
+#include "aggregate.h"
+#include "numberformat.h"
 #include <fstream>
 #include <vector>
 #include <stdexcept>
+#include <algorithm>
+#include <utility>
+
+static const Cell emptycell;
+
+//waves of recalculation smaller than this are evaluated serially, since
+//handing them to the thread pool costs more than it gains
+static const size_t PARALLEL_THRESHOLD=256;
+
+//cells with more changed dependencies than this are updated without the list
+//of changes, since going through it would hardly be cheaper than that
+static const size_t MAX_CHANGES=16;
+
+//a column gets a ColumnIndex once this many ranges of at least INDEX_MIN_ROWS
+//rows reference it; shorter ranges are scanned quickly enough. Ranges wider
+//than a tile aren't counted, so that adding them stays cheap.
+static const unsigned int INDEX_THRESHOLD=8;
+static const unsigned int INDEX_MIN_ROWS=2*CellTile::ROWS;
+//columns aren't indexed beyond this many tiles
+static const unsigned int INDEX_MAX_BLOCKS=1<<16;
+//nor for ranges wider than this
+static const unsigned int INDEX_MAX_COLUMNS=64;
+
+uint64_t CellArray::tileKey(CellAddress addr) noexcept {
+	return ((uint64_t)(addr.row>>CellTile::ROWSHIFT)<<32)|(addr.column>>CellTile::COLUMNSHIFT);
+}
 
 unsigned int CellArray::width() const noexcept {
-	return cells.size()==0?0:cells[0].size();
+	return w;
 }
 
 unsigned int CellArray::height() const noexcept {
-	return cells.size();
+	return h;
+}
+
+CellArray::~CellArray() noexcept {
+	tiles.clear(); //releases the values, before the Slab and StringPool go
+}
+
+size_t CellArray::tileCount() const noexcept {
+	return tiles.size();
+}
+
+CellTile& CellArray::tileFor(CellAddress addr){
+	unique_ptr<CellTile> &tile=tiles[tileKey(addr)];
+	if(!tile){
+		tile.reset(new CellTile(CellAddress(addr.row&~CellTile::ROWMASK,
+		                                    addr.column&~CellTile::COLUMNMASK),*values,*strings));
+	}
+	return *tile;
+}
+
+Slab& CellArray::valueSlab() const noexcept {
+	return *values;
+}
+
+StringPool& CellArray::stringPool() const noexcept {
+	return *strings;
 }
 
 Cell& CellArray::operator[](CellAddress addr) noexcept {
-	return cells[addr.row][addr.column];
+	return tileFor(addr)[addr];
 }
 
 const Cell& CellArray::operator[](CellAddress addr) const noexcept {
-	return cells[addr.row][addr.column];
+	const CellTile *tile=findTile(addr);
+	if(!tile)return emptycell;
+	return (*tile)[addr];
 }
 
 Cell& CellArray::at(CellAddress addr){
-	return cells.at(addr.row).at(addr.column);
+	if(addr.row>=h||addr.column>=w){
+		throw out_of_range("Address out of bounds in CellArray::at");
+	}
+	return (*this)[addr];
 }
 
-void CellArray::ensureSize(unsigned int w,unsigned int h){
-	resize(max(w,width()),max(h,height()));
+const CellTile* CellArray::findTile(CellAddress addr) const noexcept {
+	auto it=tiles.find(tileKey(addr));
+	if(it==tiles.end())return nullptr;
+	return it->second.get();
 }
 
-void CellArray::resize(unsigned int w,unsigned int h){
-	if(w==-1U||h==-1U){ //protection against error values
-		throw out_of_range("-1 dimension in CellArray::ensureSize");
+void CellArray::setEditString(CellAddress addr,string s){
+	CellTile &tile=tileFor(addr);
+	tile[addr].setEditString(move(s),addr,*values,*strings);
+	if(tile.publish(CellTile::index(addr)))updateIndex(addr);
+}
+
+void CellArray::setError(CellAddress addr,string_view errString){
+	CellTile &tile=tileFor(addr);
+	tile[addr].setError(errString,addr,*values,*strings);
+	clearStale(tile,addr);
+	if(tile.publish(CellTile::index(addr)))updateIndex(addr);
+}
+
+bool CellArray::update(CellAddress addr){
+	CellTile &tile=tileFor(addr);
+	tile[addr].update(*this,addr,nullptr);
+	clearStale(tile,addr);
+	if(!tile.publish(CellTile::index(addr)))return false;
+	updateIndex(addr);
+	return true;
+}
+
+bool CellArray::publish(CellAddress addr){
+	CellTile &tile=tileFor(addr);
+	clearStale(tile,addr);
+	if(!tile.publish(CellTile::index(addr)))return false;
+	updateIndex(addr);
+	return true;
+}
+
+ColumnIndex::Totals CellArray::blockTotals(CellAddress addr) const noexcept {
+	const CellTile *tile=findTile(addr);
+	if(!tile)return {0,0,0};
+	const unsigned int idx=CellTile::index(CellAddress(addr.row&~CellTile::ROWMASK,addr.column));
+	return {sumNumbers(tile->numbers+idx,CellTile::ROWS),
+	        countNonEmpty(tile->types+idx,CellTile::ROWS),
+	        countInexact(tile->numbers+idx,CellTile::ROWS)};
+}
+
+void CellArray::updateIndex(CellAddress addr){
+	if(columnindices.empty())return;
+	auto it=columnindices.find(addr.column);
+	if(it==columnindices.end())return;
+	const unsigned int block=addr.row>>CellTile::ROWSHIFT;
+	if(block>=INDEX_MAX_BLOCKS){
+		columnindices.erase(it); //rebuilt (or not) on the next reference
+		return;
+	}
+	it->second.set(block,blockTotals(addr));
+}
+
+void CellArray::buildIndex(unsigned int column){
+	columnindices.erase(column);
+	if(h==0||((h-1)>>CellTile::ROWSHIFT)>=INDEX_MAX_BLOCKS)return;
+	ColumnIndex &index=columnindices[column];
+	for(unsigned int row=0;row<h;row+=CellTile::ROWS){
+		if(findTile(CellAddress(row,column))){
+			index.set(row>>CellTile::ROWSHIFT,blockTotals(CellAddress(row,column)));
+		}
+	}
+}
+
+static bool isIndexable(CellRange range) noexcept {
+	return range.to.row-range.from.row+1>=INDEX_MIN_ROWS&&
+	       range.to.column-range.from.column<INDEX_MAX_COLUMNS;
+}
+
+void CellArray::addRangeReference(CellRange range){
+	if(!isIndexable(range))return;
+	for(unsigned int column=range.from.column;column<=range.to.column;column++){
+		if(++columnrefs[column]>=INDEX_THRESHOLD&&!columnindices.count(column)){
+			buildIndex(column);
+		}
+	}
+}
+
+void CellArray::removeRangeReference(CellRange range){
+	if(!isIndexable(range))return;
+	for(unsigned int column=range.from.column;column<=range.to.column;column++){
+		auto it=columnrefs.find(column);
+		if(it==columnrefs.end()||--it->second>0)continue;
+		columnrefs.erase(it);
+		columnindices.erase(column);
+	}
+}
+
+//the parts of the totals to compute in aggregate()
+static const unsigned int AG_SUM=1,AG_COUNT=2,AG_INEXACT=4;
+
+double CellArray::sum(CellRange range,size_t *inexact) const noexcept {
+	ColumnIndex::Totals totals{0,0,0};
+	aggregate(range,inexact?AG_SUM|AG_INEXACT:AG_SUM,totals);
+	if(inexact)*inexact=totals.inexact;
+	return totals.sum;
+}
+
+size_t CellArray::count(CellRange range) const noexcept {
+	ColumnIndex::Totals totals{0,0,0};
+	aggregate(range,AG_COUNT,totals);
+	return totals.count;
+}
+
+void CellArray::aggregate(CellRange range,unsigned int what,
+                          ColumnIndex::Totals &totals) const noexcept {
+	bool anyindexed=false;
+	for(const auto &p : columnindices){
+		if(p.first>=range.from.column&&p.first<=range.to.column)anyindexed=true;
 	}
-	if(w<width()){
-		for(size_t y=0;y<height();y++){
-			for(size_t x=width()-1;x>=w;x--){
-				cells[y].pop_back();
+	if(!anyindexed||h==0){
+		aggregateSpans(range,what,totals);
+		return;
+	}
+	const unsigned int torow=min(range.to.row,h-1);
+	if(range.from.row>torow)return;
+	for(unsigned int column=range.from.column;column<=range.to.column&&column<w;column++){
+		auto it=columnindices.find(column);
+		if(it!=columnindices.end()){
+			aggregateIndexed(it->second,column,range.from.row,torow,what,totals);
+		} else {
+			aggregateSpans(CellRange(CellAddress(range.from.row,column),
+			                         CellAddress(torow,column)),what,totals);
+		}
+	}
+}
+
+void CellArray::aggregateSpans(CellRange range,unsigned int what,
+                               ColumnIndex::Totals &totals) const noexcept {
+	for(const ValueSpan &span : spans(range)){
+		if(what&AG_SUM)totals.sum+=sumNumbers(span.numbers,span.size); //0 for non-numbers
+		if(what&AG_COUNT)totals.count+=countNonEmpty(span.types,span.size);
+		if(what&AG_INEXACT)totals.inexact+=countInexact(span.numbers,span.size);
+	}
+}
+
+void CellArray::aggregateIndexed(const ColumnIndex &index,unsigned int column,
+                                 unsigned int fromrow,unsigned int torow,
+                                 unsigned int what,ColumnIndex::Totals &totals) const noexcept {
+	//the partial tiles at the ends are scanned, the whole ones in between come
+	//from the index
+	const auto scan=[&](unsigned int row0,unsigned int row1){
+		aggregateSpans(CellRange(CellAddress(row0,column),CellAddress(row1,column)),
+		               what,totals);
+	};
+	size_t firstblock=fromrow>>CellTile::ROWSHIFT,lastblock=torow>>CellTile::ROWSHIFT;
+	if(firstblock==lastblock){
+		scan(fromrow,torow);
+		return;
+	}
+	if(fromrow&CellTile::ROWMASK){
+		scan(fromrow,fromrow|CellTile::ROWMASK);
+		firstblock++;
+	}
+	if((torow&CellTile::ROWMASK)!=CellTile::ROWMASK){
+		scan(torow&~CellTile::ROWMASK,torow);
+		lastblock--;
+	}
+	if(firstblock>lastblock)return;
+	ColumnIndex::Totals blocks{0,0,0};
+	index.query(firstblock,lastblock,blocks);
+	if(what&AG_SUM)totals.sum+=blocks.sum;
+	if(what&AG_COUNT)totals.count+=blocks.count;
+	if(what&AG_INEXACT)totals.inexact+=blocks.inexact;
+}
+
+unsigned int CellArray::level(CellAddress addr) const noexcept {
+	const CellTile *tile=findTile(addr);
+	if(!tile)return 0;
+	return tile->levels[CellTile::index(addr)];
+}
+
+void CellArray::setLevel(CellAddress addr,unsigned int level){
+	CellTile &tile=tileFor(addr);
+	tile.levels[CellTile::index(addr)]=level;
+	tile.maxlevel=max(tile.maxlevel,level);
+}
+
+void CellArray::clearStale(CellTile &tile,CellAddress addr) noexcept {
+	if(!tile.nstale)return;
+	const unsigned int idx=CellTile::index(addr);
+	const uint64_t bit=(uint64_t)1<<(idx&63);
+	if(!(tile.stale[idx>>6]&bit))return;
+	tile.stale[idx>>6]&=~bit;
+	tile.dirty[idx>>6]&=~bit;
+	tile.nstale--;
+}
+
+bool CellArray::isStale(CellAddress addr) const noexcept {
+	const CellTile *tile=findTile(addr);
+	if(!tile||!tile->nstale)return false;
+	const unsigned int idx=CellTile::index(addr);
+	return (tile->stale[idx>>6]>>(idx&63))&1;
+}
+
+bool CellArray::isDirty(CellAddress addr) const noexcept {
+	const CellTile *tile=findTile(addr);
+	if(!tile||!tile->nstale)return false;
+	const unsigned int idx=CellTile::index(addr);
+	return (tile->dirty[idx>>6]>>(idx&63))&1;
+}
+
+bool CellArray::markStale(CellAddress addr){
+	CellTile &tile=tileFor(addr);
+	const unsigned int idx=CellTile::index(addr);
+	const uint64_t bit=(uint64_t)1<<(idx&63);
+	if(tile.stale[idx>>6]&bit)return false;
+	tile.stale[idx>>6]|=bit;
+	tile.nstale++;
+	return true;
+}
+
+bool CellArray::markDirty(CellAddress addr){
+	const bool marked=markStale(addr);
+	const unsigned int idx=CellTile::index(addr);
+	tileFor(addr).dirty[idx>>6]|=(uint64_t)1<<(idx&63);
+	return marked;
+}
+
+void CellArray::clearStale(CellAddress addr) noexcept {
+	auto it=tiles.find(tileKey(addr));
+	if(it!=tiles.end())clearStale(*it->second,addr);
+}
+
+void CellArray::staleCells(CellRange range,vector<CellAddress> &out) const {
+	const unsigned int fromrow=range.from.row&~CellTile::ROWMASK;
+	const unsigned int fromcolumn=range.from.column&~CellTile::COLUMNMASK;
+	for(unsigned int row=fromrow;row<=range.to.row;row+=CellTile::ROWS){
+		for(unsigned int column=fromcolumn;column<=range.to.column;column+=CellTile::COLUMNS){
+			const CellTile *tile=findTile(CellAddress(row,column));
+			if(!tile||!tile->nstale)continue;
+			const unsigned int r0=max(row,range.from.row),c0=max(column,range.from.column);
+			const unsigned int r1=min(row+CellTile::ROWMASK,range.to.row);
+			const unsigned int c1=min(column+CellTile::COLUMNMASK,range.to.column);
+			for(unsigned int c=c0;c<=c1;c++){
+				//the bits of rows r0..r1 of the column, by word
+				const unsigned int first=CellTile::index(CellAddress(r0,c));
+				const unsigned int last=CellTile::index(CellAddress(r1,c));
+				for(unsigned int word=first>>6;word<=last>>6;word++){
+					uint64_t bits=tile->stale[word];
+					if(word==first>>6)bits&=~(uint64_t)0<<(first&63);
+					if(word==last>>6)bits&=~(uint64_t)0>>(63-(last&63));
+					for(;bits;bits&=bits-1){
+						out.push_back(tile->address(word<<6|__builtin_ctzll(bits)));
+					}
+				}
 			}
 		}
-	} else if(w>width()){
-		for(size_t y=0;y<height();y++){
-			cells[y].reserve(w);
-			for(size_t x=cells[y].size();x<w;x++){
-				cells[y].emplace_back(CellAddress(y,cells[y].size()));
+		if(row+CellTile::ROWS<row)break; //overflow
+	}
+}
+
+void CellArray::staleCells(vector<CellAddress> &out) const {
+	for(const auto &[key,tile] : tiles){
+		if(!tile->nstale)continue;
+		for(unsigned int word=0;word<CellTile::CELLS/64;word++){
+			for(uint64_t bits=tile->stale[word];bits;bits&=bits-1){
+				out.push_back(tile->address(word<<6|__builtin_ctzll(bits)));
 			}
 		}
 	}
-	if(h<height()){
-		cells.erase(cells.begin()+h,cells.end());
-	} else {
-		while(h>height()){
-			cells.emplace_back();
-			cells.back().reserve(w);
-			for(size_t x=0;x<w;x++){
-				cells.back().emplace_back(CellAddress(cells.size()-1,x));
+}
+
+void CellArray::filledCells(vector<CellAddress> &out) const {
+	for(const auto &[key,tile] : tiles){
+		for(unsigned int idx=0;idx<CellTile::CELLS;idx++){
+			if(!tile->cells[idx].isEmpty())out.push_back(tile->address(idx));
+		}
+	}
+}
+
+unsigned int CellArray::maxLevel(CellRange range) const noexcept {
+	unsigned int level=0;
+	const unsigned int fromrow=range.from.row&~CellTile::ROWMASK;
+	const unsigned int fromcolumn=range.from.column&~CellTile::COLUMNMASK;
+	for(unsigned int row=fromrow;row<=range.to.row;row+=CellTile::ROWS){
+		for(unsigned int column=fromcolumn;column<=range.to.column;column+=CellTile::COLUMNS){
+			const CellTile *tile=findTile(CellAddress(row,column));
+			if(!tile||tile->maxlevel<=level)continue;
+			const unsigned int r0=max(row,range.from.row),c0=max(column,range.from.column);
+			const unsigned int r1=min(row+CellTile::ROWMASK,range.to.row);
+			const unsigned int c1=min(column+CellTile::COLUMNMASK,range.to.column);
+			if(r0==row&&c0==column&&r1==row+CellTile::ROWMASK&&c1==column+CellTile::COLUMNMASK){
+				level=tile->maxlevel; //whole tile in range
+				continue;
+			}
+			for(unsigned int c=c0;c<=c1;c++){
+				const unsigned int *lane=tile->levels+CellTile::index(CellAddress(r0,c));
+				for(unsigned int i=0;i<=r1-r0;i++)level=max(level,lane[i]);
 			}
 		}
+		if(row+CellTile::ROWS<row)break; //overflow
+	}
+	return level;
+}
+
+valuetype_t CellArray::valueType(CellAddress addr) const noexcept {
+	const CellTile *tile=findTile(addr);
+	if(!tile)return VT_EMPTY;
+	return tile->types[CellTile::index(addr)];
+}
+
+double CellArray::numberValue(CellAddress addr) const noexcept {
+	const CellTile *tile=findTile(addr);
+	if(!tile)return 0;
+	return tile->numbers[CellTile::index(addr)];
+}
+
+valuetype_t CellArray::numberAndType(CellAddress addr,double &number) const noexcept {
+	const CellTile *tile=findTile(addr);
+	if(!tile){
+		number=0;
+		return VT_EMPTY;
+	}
+	const unsigned int idx=CellTile::index(addr);
+	number=tile->numbers[idx];
+	return tile->types[idx];
+}
+
+string_view CellArray::stringValue(CellAddress addr) const noexcept {
+	const CellTile *tile=findTile(addr);
+	if(!tile)return {};
+	const unsigned int idx=CellTile::index(addr);
+	if(tile->types[idx]!=VT_STRING)return {};
+	return strings->get(tile->strings[idx]);
+}
+
+void CellArray::ensureSize(unsigned int w,unsigned int h){
+	resize(max(w,width()),max(h,height()));
+}
+
+void CellArray::resize(unsigned int w,unsigned int h){
+	if(w==-1U||h==-1U){ //protection against error values
+		throw out_of_range("-1 dimension in CellArray::ensureSize");
+	}
+	const bool shrinks=w<this->w||h<this->h;
+	if(shrinks){
+		for(auto it=tiles.begin();it!=tiles.end();){
+			if(it->second->clearOutside(w,h))++it;
+			else it=tiles.erase(it);
+		}
+	}
+	this->w=w;
+	this->h=h;
+	if(shrinks){ //the cleared cells are still in the indices
+		vector<unsigned int> indexed;
+		for(const auto &p : columnindices)indexed.push_back(p.first);
+		for(unsigned int column : indexed)buildIndex(column);
 	}
 }
 
@@ -78,11 +457,53 @@ CellArray::const_iterator CellArray::RangeWrapper::end() const noexcept {
 
 
 
+CellArray::SpanWrapper CellArray::spans(CellRange r) const noexcept {
+	return SpanWrapper(*this,r);
+}
+
+
+CellArray::SpanWrapper::SpanWrapper(const CellArray &cells,CellRange range) noexcept
+	:cells(&cells),range(range){}
+
+CellArraySpanIt CellArray::SpanWrapper::begin() const noexcept {
+	return CellArraySpanIt(*cells,range);
+}
+
+CellArraySpanIt CellArray::SpanWrapper::end() const noexcept {
+	return CellArraySpanIt::endit();
+}
+
+
+
 CellArrayIt::CellArrayIt() noexcept
-	:cells(nullptr),begin(0,0),end(0,0),cursor(0,0),isend(true){}
+	:cells(nullptr),begin(0,0),end(0,0),cursor(0,0),isend(true),tile(nullptr){}
 
 CellArrayIt::CellArrayIt(const CellArray &cells,CellRange r) noexcept
-	:cells(&cells),begin(r.from),end(r.to),cursor(begin),isend(false){}
+		:cells(&cells),begin(r.from),end(r.to),cursor(begin),isend(false),tile(nullptr){
+	if(cells.width()==0||cells.height()==0){
+		isend=true;
+		return;
+	}
+	end.row=min(end.row,cells.height()-1);
+	end.column=min(end.column,cells.width()-1);
+	skipAbsent();
+}
+
+void CellArrayIt::skipAbsent() noexcept {
+	while(true){
+		if(cursor.column>end.column){
+			cursor.column=begin.column;
+			cursor.row++;
+		}
+		if(cursor.row>end.row||cursor.column>end.column){
+			isend=true;
+			return;
+		}
+		tile=cells->findTile(cursor);
+		if(tile)return;
+		cursor.column=(cursor.column|CellTile::COLUMNMASK)+1; //start of next tile
+	}
+}
 
 CellArrayIt CellArrayIt::endit() noexcept {
 	return CellArrayIt();
@@ -104,33 +525,125 @@ bool CellArrayIt::operator!=(const CellArrayIt &other) const noexcept {
 
 const Cell& CellArrayIt::operator*() const {
 	if(isend)throw logic_error("Dereference on end iterator (CellArrayIt)");
-	return (*cells)[cursor];
+	return (*tile)[cursor];
 }
 
 const Cell* CellArrayIt::operator->() const {
 	if(isend)throw logic_error("Dereference on end iterator (CellArrayIt)");
-	return &(*cells)[cursor];
+	return &(*tile)[cursor];
 }
 
 CellArrayIt& CellArrayIt::operator++() noexcept {
 	if(isend)return *this;
 	cursor.column++;
-	if(cursor.column>end.column||cursor.column>=cells->width()){
-		cursor.column=begin.column;
-		cursor.row++;
-		if(cursor.row>end.row){
+	//only look up a tile again when leaving the current one
+	if(cursor.column>end.column||(cursor.column&CellTile::COLUMNMASK)==0){
+		skipAbsent();
+	}
+	return *this;
+}
+
+
+
+CellArraySpanIt::CellArraySpanIt() noexcept
+	:cells(nullptr),range(CellAddress(0,0),CellAddress(0,0)),tileorigin(0,0),
+	 column(0),isend(true),tile(nullptr),span{nullptr,nullptr,0}{}
+
+CellArraySpanIt::CellArraySpanIt(const CellArray &cells,CellRange r) noexcept
+		:cells(&cells),range(r),
+		 tileorigin(r.from.row&~CellTile::ROWMASK,r.from.column&~CellTile::COLUMNMASK),
+		 column(0),isend(false),tile(nullptr),span{nullptr,nullptr,0}{
+	if(cells.width()==0||cells.height()==0){
+		isend=true;
+		return;
+	}
+	range.to.row=min(range.to.row,cells.height()-1);
+	range.to.column=min(range.to.column,cells.width()-1);
+	if(range.from.row>range.to.row||range.from.column>range.to.column){
+		isend=true;
+		return;
+	}
+	findTile();
+	if(!isend)makeSpan();
+}
+
+void CellArraySpanIt::findTile() noexcept {
+	while(true){
+		if(tileorigin.column>range.to.column){
+			tileorigin.column=range.from.column&~CellTile::COLUMNMASK;
+			tileorigin.row+=CellTile::ROWS;
+		}
+		if(tileorigin.row>range.to.row){
 			isend=true;
+			return;
 		}
+		tile=cells->findTile(tileorigin);
+		if(tile){
+			column=max(range.from.column,tileorigin.column);
+			return;
+		}
+		tileorigin.column+=CellTile::COLUMNS;
 	}
-	return *this;
 }
 
+void CellArraySpanIt::makeSpan() noexcept {
+	const unsigned int r0=max(range.from.row,tileorigin.row)-tileorigin.row;
+	const unsigned int r1=min(range.to.row,tileorigin.row+CellTile::ROWMASK)-tileorigin.row;
+	const unsigned int c1=min(range.to.column,tileorigin.column+CellTile::COLUMNMASK);
+	unsigned int idx=(column-tileorigin.column)<<CellTile::ROWSHIFT;
+	if(r0==0&&r1==CellTile::ROWMASK){
+		//full columns of the tile are contiguous, so merge them in one span
+		span.size=(c1-column+1)<<CellTile::ROWSHIFT;
+		column=c1;
+	} else {
+		idx+=r0;
+		span.size=r1-r0+1;
+	}
+	span.types=tile->types+idx;
+	span.numbers=tile->numbers+idx;
+}
 
+CellArraySpanIt CellArraySpanIt::endit() noexcept {
+	return CellArraySpanIt();
+}
+
+bool CellArraySpanIt::operator==(const CellArraySpanIt &other) const noexcept {
+	if(isend||other.isend)return isend==other.isend;
 
-Spreadsheet::Spreadsheet(unsigned int width,unsigned int height){
-	ensureSheetSize(width,height);
+	return cells==other.cells&&
+	       range==other.range&&
+	       tileorigin==other.tileorigin&&
+	       column==other.column;
 }
 
+bool CellArraySpanIt::operator!=(const CellArraySpanIt &other) const noexcept {
+	return !operator==(other);
+}
+
+const ValueSpan& CellArraySpanIt::operator*() const {
+	if(isend)throw logic_error("Dereference on end iterator (CellArraySpanIt)");
+	return span;
+}
+
+const ValueSpan* CellArraySpanIt::operator->() const {
+	if(isend)throw logic_error("Dereference on end iterator (CellArraySpanIt)");
+	return &span;
+}
+
+CellArraySpanIt& CellArraySpanIt::operator++() noexcept {
+	if(isend)return *this;
+	column++;
+	if(column>min(range.to.column,tileorigin.column+CellTile::COLUMNMASK)){
+		tileorigin.column+=CellTile::COLUMNS;
+		findTile();
+		if(isend)return *this;
+	}
+	makeSpan();
+	return *this;
+}
+
+
+
 unsigned int Spreadsheet::getWidth() const noexcept {
 	return cells.width();
 }
@@ -140,7 +653,9 @@ unsigned int Spreadsheet::getHeight() const noexcept {
 }
 
 bool Spreadsheet::inBounds(CellAddress addr) const noexcept {
-	return addr.row<getHeight()&&addr.column<getWidth();
+	//the sheet needs to be able to grow to contain addr, so row+1 and column+1
+	//may neither wrap to 0 nor be -1, an invalid dimension for CellArray
+	return addr.row<-1U-1&&addr.column<-1U-1;
 }
 
 
@@ -148,68 +663,120 @@ bool Spreadsheet::inBounds(CellAddress addr) const noexcept {
 Serialisation file format:
 Every number is stored as an unsigned 32-bit int, in little-endian order.
 Every string stored is prefixed with its length.
-The file starts with the width and height of the sheet. Then the number of
-revdepsOutside, followed by them, in pairs.
-Finally all the cells, in row-major order.
+The file starts with SPARSE_MAGIC, which no older file starts with since it
+isn't a valid width, and the version of the format, SPARSE_VERSION. Then the
+width and height of the sheet, the number of non-empty cells, and those cells,
+in row-major order: each is its address followed by the cell itself.
+
+Older files have no version, and store every cell of the sheet. They start
+with the width and height of the sheet. Then the number of reverse dependency
+lists outside the sheet area, followed by them, in pairs. Finally all the
+cells, in row-major order, including the empty ones.
+Reverse dependencies are rebuilt from the formulas on load, so they are
+written as empty lists, and ignored when reading older files.
 */
 
+static const uint32_t SPARSE_MAGIC=0xffffffff;
+static const uint32_t SPARSE_VERSION=1;
+
 bool Spreadsheet::saveToDisk(string fname) {
 	ofstream out(fname);
 	if(out.fail())return false;
-	unsigned int x,y,w=getWidth(),h=getHeight();
-	writeUInt32LE(out,w);
-	writeUInt32LE(out,h);
-	writeUInt32LE(out,revdepsOutside.size());
-	for(const pair<CellAddress,set<CellAddress>> &p : revdepsOutside){
-		p.first.serialise(out);
-		writeUInt32LE(out,p.second.size());
-		for(const CellAddress &addr : p.second){
-			addr.serialise(out);
-		}
-	}
-	string text;
-	for(y=0;y<h;y++)for(x=0;x<w;x++){
-		cells[CellAddress(y,x)].serialise(out);
+	vector<CellAddress> filled;
+	cells.filledCells(filled);
+	sort(filled.begin(),filled.end(),less<CellAddress>());
+	writeUInt32LE(out,SPARSE_MAGIC);
+	writeUInt32LE(out,SPARSE_VERSION);
+	writeUInt32LE(out,getWidth());
+	writeUInt32LE(out,getHeight());
+	writeUInt32LE(out,filled.size());
+	for(const CellAddress &addr : filled){
+		addr.serialise(out);
+		as_const(cells)[addr].serialise(out,addr,cells.stringPool());
 		if(out.fail()){
 			out.close();
 			return false;
 		}
 	}
 	out.close();
+	if(out.fail())return false;
 	changedSinceSave=false;
 	return true;
 }
 
+//reads a cell into cells at addr; returns whether successful. Empty cells
+//don't allocate a tile.
+static bool readCell(istream &in,CellAddress addr,CellArray &cells,
+                     vector<CellAddress> &filled){
+	//read into a temporary, so that empty cells don't allocate tiles
+	Cell cell;
+	cell.deserialise(in,addr,cells.valueSlab(),cells.stringPool());
+	if(!in.fail()&&cell.isEmpty())return true;
+	Cell *target=in.fail()?nullptr:&cells[addr];
+	if(!target||!target->isEmpty()){ //read error, or a cell stored twice
+		cell.clear(cells.valueSlab(),cells.stringPool());
+		return false;
+	}
+	target->swapValue(cell);
+	filled.push_back(addr);
+	return true;
+}
+
 bool Spreadsheet::loadFromDisk(string fname){
 	ifstream in(fname);
 	if(in.fail())return false;
 	unsigned int x,y,w,h;
 	w=readUInt32LE(in);
-	h=readUInt32LE(in);
-	if(in.fail())return false;
-	cells.resize(w,h);
-	unsigned int nrdo=readUInt32LE(in);
 	if(in.fail())return false;
-	revdepsOutside.reserve(nrdo);
-	for(x=0;x<nrdo;x++){
-		CellAddress a=CellAddress::deserialise(in);
-		int n=readUInt32LE(in);
-		if(in.fail())return false;
-		set<CellAddress> targets;
-		for(int i=0;i<n;i++){
-			targets.insert(CellAddress::deserialise(in));
+	//no other thread sees the new cells until they're complete
+	CellArray newcells;
+	newcells.stringPool().setShared(false);
+	vector<CellAddress> filled;
+	if(w==SPARSE_MAGIC){
+		const unsigned int version=readUInt32LE(in);
+		w=readUInt32LE(in);
+		h=readUInt32LE(in);
+		const unsigned int n=readUInt32LE(in);
+		if(in.fail()||version!=SPARSE_VERSION||w==-1U||h==-1U)return false;
+		newcells.resize(w,h);
+		newcells.stringPool().reserve(n);
+		for(unsigned int i=0;i<n;i++){
+			const CellAddress addr=CellAddress::deserialise(in);
+			if(in.fail()||addr.row>=h||addr.column>=w)return false;
+			if(!readCell(in,addr,newcells,filled))return false;
 		}
-		revdepsOutside.emplace(a,targets);
-	}
-	string text;
-	for(y=0;y<h;y++)for(x=0;x<w;x++){
-		cells[CellAddress(y,x)].deserialise(in);
+	} else {
+		h=readUInt32LE(in);
+		if(in.fail()||w==-1U||h==-1U)return false;
+		unsigned int nrdo=readUInt32LE(in);
 		if(in.fail())return false;
-	}
-	for(y=0;y<h;y++)for(x=0;x<w;x++){
-		recursiveUpdate(CellAddress(y,x),nullptr,true);
+		for(x=0;x<nrdo;x++){
+			CellAddress::deserialise(in);
+			unsigned int n=readUInt32LE(in);
+			if(in.fail())return false;
+			for(unsigned int i=0;i<n;i++){
+				CellAddress::deserialise(in);
+			}
+		}
+		newcells.resize(w,h);
+		for(y=0;y<h;y++)for(x=0;x<w;x++){
+			if(!readCell(in,CellAddress(y,x),newcells,filled))return false;
+		}
 	}
 	in.close();
+	newcells.stringPool().setShared(true);
+	cells=move(newcells);
+	celldeps=DependencyGraph();
+	rangedeps=RangeIndex();
+	circular.clear();
+	circularvia.clear();
+	intransaction=false;
+	pending=move(filled);
+	pendingold.clear();
+	pendingset.clear();
+	commitPending();
+	//a loaded sheet has no old values to show
+	if(calcmode==CM_MANUAL)recalculateStale();
 	changedSinceSave=false;
 	return true;
 }
@@ -217,150 +784,517 @@ bool Spreadsheet::loadFromDisk(string fname){
 
 Maybe<string> Spreadsheet::getCellDisplayString(CellAddress addr) noexcept {
 	if(!inBounds(addr))return Nothing();
-	return cells[addr].getDisplayString();
+	evaluateStale(addr);
+	//read through the const operator[], which doesn't allocate a tile
+	char buf[NUMBER_BUFSIZE];
+	return string(as_const(cells)[addr].getDisplayString(cells.stringPool(),buf));
 }
 
-Maybe<string> Spreadsheet::getCellEditString(CellAddress addr) noexcept {
+Maybe<string> Spreadsheet::getCellDisplayString(CellAddress addr,size_t width) noexcept {
 	if(!inBounds(addr))return Nothing();
-	return cells[addr].getEditString();
+	evaluateStale(addr);
+	double number;
+	if(cells.numberAndType(addr,number)==VT_NUMBER){
+		char buf[NUMBER_BUFSIZE];
+		return string(buf,formatFitted(number,width,buf));
+	}
+	char buf[NUMBER_BUFSIZE];
+	return string(as_const(cells)[addr].getDisplayString(cells.stringPool(),buf).substr(0,width));
 }
 
-bool Spreadsheet::checkCircularDependencies(CellAddress addr) noexcept {
-	set<CellAddress> seen;
-	return checkCircularDependencies(addr,seen);
+Maybe<string> Spreadsheet::getCellEditString(CellAddress addr) const noexcept {
+	if(!inBounds(addr))return Nothing();
+	return cells[addr].getEditString(addr,cells.stringPool());
 }
 
-bool Spreadsheet::checkCircularDependencies(CellAddress addr,set<CellAddress> &seen) noexcept {
-	pair<set<CellAddress>::iterator,bool> insertret=seen.insert(addr);
-	if(!insertret.second){ //already existed
-		return true;
+void Spreadsheet::updateLevels(CellAddress dest,const Dependencies &deps){
+	unsigned int level=0;
+	for(const CellAddress &depaddr : deps.cells){
+		level=max(level,cells.level(depaddr)+1);
 	}
-	for(const CellAddress &revdepaddr : cells[addr].getReverseDependencies()){
-		if(checkCircularDependencies(revdepaddr,seen))return true;
+	for(const CellRange &range : deps.ranges){
+		level=max(level,cells.maxLevel(range)+1);
+	}
+	//lowering the level of dest is fine, since its dependents are above its
+	//old level anyway
+	cells.setLevel(dest,level);
+
+	vector<CellAddress> stack{dest},revdeps;
+	while(stack.size()){
+		const CellAddress addr=stack.back();
+		stack.pop_back();
+		const unsigned int addrlevel=cells.level(addr);
+		revdeps.clear();
+		collectDependents(addr,revdeps);
+		for(const CellAddress &revdepaddr : revdeps){
+			if(cells.level(revdepaddr)>addrlevel)continue;
+			cells.setLevel(revdepaddr,addrlevel+1);
+			stack.push_back(revdepaddr);
+		}
+	}
+}
+
+bool Spreadsheet::findCycle(CellAddress dest,const Dependencies &deps,
+                            vector<CellAddress> &path) const {
+	unsigned int maxlevel=0;
+	for(const CellAddress &depaddr : deps.cells){
+		maxlevel=max(maxlevel,cells.level(depaddr));
+	}
+	for(const CellRange &range : deps.ranges){
+		maxlevel=max(maxlevel,cells.maxLevel(range));
+	}
+	unordered_map<CellAddress,CellAddress> parent; //of each visited cell
+	vector<CellAddress> stack{dest},revdeps;
+	while(stack.size()){
+		const CellAddress addr=stack.back();
+		stack.pop_back();
+		revdeps.clear();
+		collectDependents(addr,revdeps);
+		for(const CellAddress &revdepaddr : revdeps){
+			if(!parent.emplace(revdepaddr,addr).second)continue;
+			if(deps.contains(revdepaddr)){
+				path.clear();
+				for(CellAddress a=revdepaddr;!(a==dest);a=parent.at(a))path.push_back(a);
+				reverse(path.begin(),path.end());
+				return true;
+			}
+			if(cells.level(revdepaddr)<maxlevel)stack.push_back(revdepaddr);
+		}
 	}
-	seen.erase(insertret.first);
 	return false;
 }
 
-set<CellAddress> Spreadsheet::recursiveUpdate(CellAddress addr,
-                                              bool *circularrefs,
-                                              bool updatefirst) noexcept {
-	if(circularrefs){
-		if(checkCircularDependencies(addr)){
-			*circularrefs=true;
-			return set<CellAddress>();
+void Spreadsheet::addCircular(CellAddress addr,const vector<CellAddress> &path){
+	circular[addr]=path;
+	for(const CellAddress &via : path)circularvia.emplace(via,addr);
+}
+
+bool Spreadsheet::removeCircular(CellAddress addr) noexcept {
+	auto it=circular.find(addr);
+	if(it==circular.end())return false;
+	for(const CellAddress &via : it->second){
+		auto [from,to]=circularvia.equal_range(via);
+		for(auto jt=from;jt!=to;++jt){
+			if(jt->second==addr){
+				circularvia.erase(jt);
+				break;
+			}
+		}
+	}
+	circular.erase(it);
+	return true;
+}
+
+set<CellAddress> Spreadsheet::retryCircular(const vector<CellAddress> &edited) noexcept {
+	set<CellAddress> candidates;
+	for(const CellAddress &addr : edited){
+		auto [from,to]=circularvia.equal_range(addr);
+		for(auto it=from;it!=to;++it)candidates.insert(it->second);
+	}
+	vector<CellAddress> attached,path;
+	for(const CellAddress &addr : candidates){
+		const Dependencies deps=cells[addr].getDependencies(addr,cells.stringPool());
+		removeCircular(addr);
+		if(findCycle(addr,deps,path)){
+			addCircular(addr,path);
+			continue;
+		}
+		updateLevels(addr,deps);
+		attachRevdeps(deps,addr);
+		attached.push_back(addr);
+	}
+	if(attached.empty())return {};
+	if(calcmode!=CM_AUTOMATIC)return invalidate(attached,{});
+	return recalculate(attached,{},{});
+}
+
+set<CellAddress> Spreadsheet::recalculate(const vector<CellAddress> &evaluate,
+                                          const vector<CellAddress> &preset,
+                                          const vector<ValueChange> &oldvalues) noexcept {
+	//collect the dirty closure of the seeds, with the dependency edges within
+	vector<CellAddress> dirty;
+	unordered_map<CellAddress,unsigned int> index;
+	vector<vector<unsigned int>> dependents;
+	vector<unsigned int> indegree;
+	for(const CellAddress &addr : evaluate){
+		if(index.emplace(addr,dirty.size()).second)dirty.push_back(addr);
+	}
+	const unsigned int nevaluate=dirty.size();
+	for(const CellAddress &addr : preset){
+		if(index.emplace(addr,dirty.size()).second)dirty.push_back(addr);
+	}
+	const unsigned int nseeds=dirty.size();
+	vector<CellAddress> revdeps;
+	for(unsigned int i=0;i<dirty.size();i++){
+		revdeps.clear();
+		collectDependents(dirty[i],revdeps);
+		vector<unsigned int> edges;
+		edges.reserve(revdeps.size());
+		for(const CellAddress &revdepaddr : revdeps){
+			auto it=index.emplace(revdepaddr,dirty.size()).first;
+			if(it->second==dirty.size())dirty.push_back(revdepaddr);
+			edges.push_back(it->second);
+		}
+		dependents.push_back(move(edges));
+	}
+	indegree.resize(dirty.size(),0);
+	for(const vector<unsigned int> &edges : dependents){
+		for(unsigned int j : edges)indegree[j]++;
+	}
+
+	//Kahn's algorithm, in waves: the cells in a wave only depend on cells in
+	//earlier waves, so they can be evaluated in parallel. The graph is acyclic
+	//(see updateLevels), but don't loop if it isn't.
+	//Only cells with a changed dependency are stale and need evaluating; the
+	//seeds count as changed, since the caller changed them.
+	//Cells are told which of their dependencies changed, and the old values of
+	//those, so that formulas can update aggregates by the difference; a cell
+	//with a dependency whose old value isn't known gets an incomplete list.
+	vector<bool> done(dirty.size(),false);
+	vector<bool> stale(dirty.size(),false),changed(dirty.size(),false);
+	vector<ValueChange> old(dirty.size());
+	vector<bool> known(dirty.size(),false),incomplete(dirty.size(),false);
+	vector<vector<unsigned int>> changedby(dirty.size());
+	vector<unsigned int> ready,finished,wave; //wave: stale part of finished
+	vector<Cell*> wavecells;
+	vector<ValueChange> wavechanges;
+	vector<ChangeList> wavelists;
+	for(const ValueChange &change : oldvalues){
+		auto it=index.find(change.addr);
+		if(it==index.end()||it->second>=nseeds)continue;
+		old[it->second]=change;
+		known[it->second]=true;
+	}
+	for(unsigned int i=0;i<dirty.size();i++){
+		if(indegree[i]==0)ready.push_back(i);
+	}
+	for(unsigned int i=0;i<nseeds;i++){
+		stale[i]=i<nevaluate;
+		changed[i]=true;
+	}
+	unsigned int ndone=0,firstundone=0;
+	while(ndone<dirty.size()){
+		if(ready.empty()){
+			//only cycles left; break them at the first cell not yet done
+			while(done[firstundone])firstundone++;
+			ready.push_back(firstundone);
+		}
+		finished.clear();
+		wave.clear();
+		wavecells.clear();
+		for(unsigned int i : ready){
+			if(done[i])continue;
+			done[i]=true;
+			ndone++;
+			finished.push_back(i);
+			if(!stale[i])continue;
+			wave.push_back(i);
+			wavecells.push_back(&cells[dirty[i]]);
+		}
+		wavechanges.clear();
+		wavelists.clear();
+		for(unsigned int i : wave){
+			for(unsigned int j : changedby[i])wavechanges.push_back(old[j]);
+			wavelists.push_back({nullptr,changedby[i].size(),!incomplete[i]});
+		}
+		for(size_t k=0,offset=0;k<wave.size();offset+=wavelists[k].size,k++){
+			wavelists[k].changes=wavechanges.data()+offset;
+		}
+		//evaluation only reads the published values of earlier waves, and
+		//writes its own cell; publishing touches the string pool, so is serial
+		if(wavecells.size()>=PARALLEL_THRESHOLD){
+			ThreadPool::shared().parallelFor(wavecells.size(),[&](size_t k){
+				wavecells[k]->update(cells,dirty[wave[k]],&wavelists[k]);
+			});
 		} else {
-			*circularrefs=false;
+			for(size_t k=0;k<wave.size();k++)wavecells[k]->update(cells,dirty[wave[k]],&wavelists[k]);
+		}
+		for(unsigned int k=0;k<wave.size();k++){
+			const unsigned int i=wave[k];
+			if(i>=nseeds){
+				old[i].addr=dirty[i];
+				old[i].oldtype=cells.numberAndType(dirty[i],old[i].oldnumber);
+				known[i]=true;
+			}
+			if(cells.publish(dirty[i]))changed[i]=true;
+		}
+		ready.clear();
+		for(unsigned int i : finished){
+			for(unsigned int j : dependents[i]){
+				if(changed[i]){
+					stale[j]=true;
+					if(!known[i]||changedby[j].size()>=MAX_CHANGES)incomplete[j]=true;
+					else changedby[j].push_back(i);
+				}
+				if(indegree[j]>0&&--indegree[j]==0&&!done[j])ready.push_back(j);
+			}
 		}
 	}
-	Cell &cell=cells[addr];
-	if(updatefirst)cell.update(cells);
-	set<CellAddress> seen;
-	seen.insert(addr);
-	set<CellAddress> revdeps=cell.getReverseDependencies();
-	while(revdeps.size()){
-		set<CellAddress> newrevdeps;
-		for(CellAddress revdepaddr : revdeps){
-			seen.insert(revdepaddr);
-			Cell &revdepcell=cells[revdepaddr];
-			revdepcell.update(cells);
-			const set<CellAddress> d=revdepcell.getReverseDependencies();
-			newrevdeps.insert(d.begin(),d.end());
+	set<CellAddress> result;
+	for(unsigned int i=0;i<dirty.size();i++){
+		if(changed[i])result.insert(dirty[i]);
+	}
+	return result;
+}
+
+set<CellAddress> Spreadsheet::invalidate(const vector<CellAddress> &evaluate,
+                                         const vector<CellAddress> &preset) noexcept {
+	set<CellAddress> result(evaluate.begin(),evaluate.end());
+	result.insert(preset.begin(),preset.end());
+	vector<CellAddress> stack,revdeps;
+	for(const CellAddress &addr : evaluate)cells.markDirty(addr);
+	//seeds count as changed, like in recalculate
+	for(const vector<CellAddress> *seeds : {&evaluate,&preset}){
+		for(const CellAddress &addr : *seeds){
+			revdeps.clear();
+			collectDependents(addr,revdeps);
+			for(const CellAddress &revdepaddr : revdeps){
+				if(!cells.markDirty(revdepaddr))continue;
+				result.insert(revdepaddr);
+				stack.push_back(revdepaddr);
+			}
 		}
-		revdeps=move(newrevdeps);
 	}
-	return seen;
+	while(stack.size()){
+		const CellAddress addr=stack.back();
+		stack.pop_back();
+		revdeps.clear();
+		collectDependents(addr,revdeps);
+		for(const CellAddress &revdepaddr : revdeps){
+			if(!cells.markStale(revdepaddr))continue;
+			result.insert(revdepaddr);
+			stack.push_back(revdepaddr);
+		}
+	}
+	return result;
+}
+
+void Spreadsheet::evaluateStale(CellAddress addr) noexcept {
+	if(calcmode!=CM_LAZY||!cells.isStale(addr))return;
+	refreshStale({addr});
+}
+
+set<CellAddress> Spreadsheet::refreshStale(const vector<CellAddress> &addrs) noexcept {
+	//only stale cells can have a value that is out of date, so those are all
+	//that need evaluating
+	vector<CellAddress> order,found;
+	unordered_set<CellAddress> seen;
+	for(const CellAddress &addr : addrs){
+		if(cells.isStale(addr)&&seen.insert(addr).second)order.push_back(addr);
+	}
+	for(size_t i=0;i<order.size();i++){
+		const Dependencies deps=as_const(cells)[order[i]].getDependencies(order[i],cells.stringPool());
+		found.clear();
+		for(const CellAddress &depaddr : deps.cells){
+			if(cells.isStale(depaddr))found.push_back(depaddr);
+		}
+		for(const CellRange &range : deps.ranges)cells.staleCells(range,found);
+		for(const CellAddress &depaddr : found){
+			if(seen.insert(depaddr).second)order.push_back(depaddr);
+		}
+	}
+	return refresh(order);
+}
+
+set<CellAddress> Spreadsheet::refresh(const vector<CellAddress> &stale) noexcept {
+	//a cell has a higher level than all of its dependencies
+	vector<pair<unsigned int,CellAddress>> levels;
+	levels.reserve(stale.size());
+	for(const CellAddress &cell : stale)levels.emplace_back(cells.level(cell),cell);
+	sort(levels.begin(),levels.end(),[](const auto &a,const auto &b){return a.first<b.first;});
+	set<CellAddress> result;
+	vector<CellAddress> wave,revdeps;
+	vector<Cell*> wavecells;
+	for(size_t i=0;i<levels.size();){
+		const unsigned int level=levels[i].first;
+		wave.clear();
+		wavecells.clear();
+		for(;i<levels.size()&&levels[i].first==level;i++){
+			const CellAddress addr=levels[i].second;
+			if(cells.isDirty(addr)){
+				wave.push_back(addr);
+				wavecells.push_back(&cells[addr]);
+			} else cells.clearStale(addr); //none of its dependencies changed
+		}
+		if(wavecells.size()>=PARALLEL_THRESHOLD){
+			ThreadPool::shared().parallelFor(wavecells.size(),[&](size_t k){
+				wavecells[k]->update(cells,wave[k],nullptr);
+			});
+		} else {
+			for(size_t k=0;k<wave.size();k++)wavecells[k]->update(cells,wave[k],nullptr);
+		}
+		for(const CellAddress &addr : wave){
+			if(!cells.publish(addr))continue;
+			result.insert(addr);
+			revdeps.clear();
+			collectDependents(addr,revdeps);
+			for(const CellAddress &revdepaddr : revdeps)cells.markDirty(revdepaddr);
+		}
+	}
+	return result;
 }
 
 set<CellAddress> Spreadsheet::propagateError(CellAddress addr) noexcept {
-	Cell &cell=cells[addr];
-	const string &errString=cell.getDisplayString().substr(4); //strip "ERR:"
+	char buf[NUMBER_BUFSIZE];
+	const string errString(cells[addr].getDisplayString(cells.stringPool(),buf).substr(4)); //strip "ERR:"
 	set<CellAddress> seen;
 	seen.insert(addr);
-	set<CellAddress> revdeps=cell.getReverseDependencies();
+	vector<CellAddress> revdeps,newrevdeps;
+	collectDependents(addr,revdeps);
 	while(revdeps.size()){
-		set<CellAddress> newrevdeps;
+		newrevdeps.clear();
 		for(CellAddress revdepaddr : revdeps){
 			if(!seen.insert(revdepaddr).second){
 				continue;
 			}
-			Cell &revdepcell=cells[revdepaddr];
-			revdepcell.setError(errString);
-			const set<CellAddress> d=revdepcell.getReverseDependencies();
-			newrevdeps.insert(d.begin(),d.end());
+			cells.setError(revdepaddr,errString);
+			collectDependents(revdepaddr,newrevdeps);
 		}
-		revdeps=move(newrevdeps);
+		revdeps.swap(newrevdeps);
 	}
 	return seen;
 }
 
-void Spreadsheet::attachRevdeps(const vector<CellAddress> &depaddrs,CellAddress dest) noexcept {
-	for(const CellAddress &depaddr : depaddrs){
-		if(inBounds(depaddr)){
-			cells[depaddr].addReverseDependency(dest);
-		} else {
-			auto it=revdepsOutside.find(depaddr);
-			if(it==revdepsOutside.end()){
-				revdepsOutside.emplace(depaddr,set<CellAddress>{dest});
-			} else {
-				it->second.insert(dest);
-			}
-		}
+void Spreadsheet::collectDependents(CellAddress addr,vector<CellAddress> &out) const {
+	const size_t from=out.size();
+	celldeps.dependents(addr,out);
+	rangedeps.query(addr,out);
+	sort(out.begin()+from,out.end(),less<CellAddress>());
+	out.erase(unique(out.begin()+from,out.end()),out.end());
+}
+
+void Spreadsheet::attachRevdeps(const Dependencies &deps,CellAddress dest) noexcept {
+	for(const CellAddress &depaddr : deps.cells){
+		celldeps.insert(depaddr,dest);
+	}
+	for(const CellRange &range : deps.ranges){
+		rangedeps.insert(range,dest);
+		cells.addRangeReference(range);
 	}
 }
 
-void Spreadsheet::detachRevdeps(const vector<CellAddress> &depaddrs,CellAddress dest) noexcept {
-	for(const CellAddress &depaddr : depaddrs){
-		if(inBounds(depaddr)){
-			cells[depaddr].removeReverseDependency(dest);
-		} else {
-			auto it=revdepsOutside.find(depaddr);
-			if(it!=revdepsOutside.end()){
-				auto vit=it->second.find(dest);
-				if(vit!=it->second.end()){
-					it->second.erase(vit);
-				}
-			}
-		}
+void Spreadsheet::detachRevdeps(const Dependencies &deps,CellAddress dest) noexcept {
+	for(const CellAddress &depaddr : deps.cells){
+		celldeps.erase(depaddr,dest);
+	}
+	//a self-circular cell was never attached, so only drop references that
+	//were actually added
+	for(const CellRange &range : deps.ranges){
+		if(rangedeps.erase(range,dest))cells.removeRangeReference(range);
 	}
 }
 
 Maybe<set<CellAddress>> Spreadsheet::changeCellValue(CellAddress addr,string repr) noexcept {
 	if(!inBounds(addr))return Nothing();
+	//clearing a cell that was never written to changes nothing, and shouldn't
+	//allocate its tile
+	if(repr.empty()&&!cells.findTile(addr)){
+		if(intransaction)return set<CellAddress>();
+		return set<CellAddress>{addr};
+	}
 	changedSinceSave=true;
+	if(repr.size())cells.ensureSize(addr.column+1,addr.row+1);
 	Cell &cell=cells[addr];
-	detachRevdeps(cell.getDependencies(),addr);
-	cell.setEditString(repr);
-	const vector<CellAddress> newcelldeps=cell.getDependencies();
-	for(const CellAddress &depaddr : newcelldeps){
-		if(depaddr==addr){
-			cell.setError("Self-circular reference");
-			return recursiveUpdate(addr,nullptr,false);
-		}
-	}
-	attachRevdeps(newcelldeps,addr);
-	bool circularrefs;
-	set<CellAddress> changed=recursiveUpdate(addr,&circularrefs,true);
-	if(!circularrefs){
-		return changed;
+	if(pendingset.insert(addr).second){
+		if(!removeCircular(addr))detachRevdeps(cell.getDependencies(addr,cells.stringPool()),addr);
+		pending.push_back(addr);
+		ValueChange change;
+		change.addr=addr;
+		change.oldtype=cells.numberAndType(addr,change.oldnumber);
+		pendingold.push_back(change);
 	}
-	cell.setError("Circular reference chain");
-	return propagateError(addr);
+	cells.setEditString(addr,repr);
+	if(intransaction)return set<CellAddress>();
+	return commitPending();
 }
 
-void Spreadsheet::ensureSheetSize(unsigned int width,unsigned int height){
-	cells.ensureSize(width,height);
-	vector<CellAddress> toerase;
-	for(const pair<CellAddress,set<CellAddress>> &p : revdepsOutside){
-		if(!inBounds(p.first))continue;
-		cells[p.first].addReverseDependencies(p.second);
-		toerase.push_back(p.first);
+set<CellAddress> Spreadsheet::commitPending() noexcept {
+	vector<CellAddress> evaluate,preset,newcircular,path;
+	for(const CellAddress &addr : pending){
+		const Dependencies deps=cells[addr].getDependencies(addr,cells.stringPool());
+		if(deps.contains(addr)){
+			cells.setError(addr,"Self-circular reference");
+			preset.push_back(addr);
+		} else if(findCycle(addr,deps,path)){
+			cells.setError(addr,"Circular reference chain");
+			addCircular(addr,path);
+			newcircular.push_back(addr);
+		} else {
+			updateLevels(addr,deps);
+			attachRevdeps(deps,addr);
+			evaluate.push_back(addr);
+		}
 	}
-	for(const CellAddress &addr : toerase){
-		revdepsOutside.erase(revdepsOutside.find(addr));
+	const vector<CellAddress> edited=move(pending);
+	const vector<ValueChange> oldvalues=move(pendingold);
+	pending.clear();
+	pendingold.clear();
+	pendingset.clear();
+	set<CellAddress> changed=calcmode==CM_AUTOMATIC?recalculate(evaluate,preset,oldvalues):
+	                                                invalidate(evaluate,preset);
+	//in CM_MANUAL, edited cells show their new value right away, computed from
+	//what their dependencies show now; they stay dirty, so that
+	//recalculateStale still evaluates them after those
+	if(calcmode==CM_MANUAL){
+		for(const CellAddress &addr : evaluate){
+			cells.update(addr);
+			cells.markDirty(addr);
+		}
+	}
+	//an error set on a cell that depends on stale cells would go stale without
+	//being marked, so bring the cells that propagateError overwrites up to
+	//date first; only those, and the stale cells they depend on
+	if(calcmode!=CM_AUTOMATIC&&newcircular.size()){
+		vector<CellAddress> overwritten=newcircular;
+		unordered_set<CellAddress> seen;
+		for(size_t i=0;i<overwritten.size();i++){
+			if(!seen.insert(overwritten[i]).second)continue;
+			collectDependents(overwritten[i],overwritten);
+		}
+		const set<CellAddress> refreshed=refreshStale(overwritten);
+		changed.insert(refreshed.begin(),refreshed.end());
 	}
+	for(const CellAddress &addr : newcircular){
+		const set<CellAddress> errored=propagateError(addr);
+		changed.insert(errored.begin(),errored.end());
+	}
+	const set<CellAddress> retried=retryCircular(edited);
+	changed.insert(retried.begin(),retried.end());
+	return changed;
+}
+
+void Spreadsheet::beginTransaction() noexcept {
+	intransaction=true;
+}
+
+set<CellAddress> Spreadsheet::commitTransaction() noexcept {
+	intransaction=false;
+	return commitPending();
+}
+
+bool Spreadsheet::inTransaction() const noexcept {
+	return intransaction;
 }
 
 bool Spreadsheet::isClobbered() const noexcept {
 	return changedSinceSave;
 }
+
+size_t Spreadsheet::tileCount() const noexcept {
+	return cells.tileCount();
+}
+
+void Spreadsheet::setCalcMode(calcmode_t mode) noexcept {
+	calcmode=mode;
+	if(mode==CM_AUTOMATIC)recalculateStale();
+}
+
+calcmode_t Spreadsheet::getCalcMode() const noexcept {
+	return calcmode;
+}
+
+set<CellAddress> Spreadsheet::recalculateStale() noexcept {
+	vector<CellAddress> stale;
+	cells.staleCells(stale);
+	return refresh(stale);
+}
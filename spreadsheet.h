@@ -2,10 +2,20 @@
 
 #include "celladdress.h"
 #include "cell.h"
+#include "celltile.h"
+#include "stringpool.h"
+#include "slab.h"
+#include "dependencygraph.h"
+#include "rangeindex.h"
+#include "columnindex.h"
 #include <vector>
 #include <set>
+#include <map>
 #include <unordered_map>
+#include <unordered_set>
+#include <memory>
 #include <string>
+#include <cstdint>
 
 using namespace std;
 
@@ -15,23 +25,98 @@ This defines CellArray, the container for the actual array of cells in use in
 Spreadsheet, and Spreadsheet itself.
 
 CellArray is a 2D store of Cell's. Cell access is via CellAddress'es; a
-const_iterator type is provided via range() using a CellRange.
+const_iterator type is provided via range() using a CellRange. For bulk reads
+of typed values, spans() provides the same range as contiguous runs of the
+value lanes of the tiles (see ValueSpan); sum() and count() aggregate a range,
+using a ColumnIndex for columns that are referenced by many long ranges.
+The store is sparse: cells are allocated in CellTile's, which are only created
+when a cell in them is accessed for writing. Reading a cell in a tile that
+doesn't exist yields an empty cell, and iteration skips such tiles entirely.
+The const members only read, so they may be used from several threads at once,
+as long as no thread is modifying the CellArray.
 
 Spreadsheet is a high-level spreadsheet object, usable without direct knowledge
 of the actual implementation of the values; notably including formulas, which
-are transparently handled.
+are transparently handled. Recalculation evaluates independent formulas in
+parallel on ThreadPool::shared() when there are enough of them. In the lazy and
+manual calculation modes, an edit only marks the cells depending on it as
+stale, so that its cost doesn't depend on the size of the sheet.
 */
 
 class Cell;
 
 class CellArrayIt;
+class CellArraySpanIt;
+
+//A contiguous run of typed cell values, as produced by CellArray::spans()
+struct ValueSpan{
+	const valuetype_t *types;
+	const double *numbers;
+	unsigned int size;
+};
+
+//The typed value a cell had before it changed
+struct ValueChange{
+	CellAddress addr=CellAddress(0,0);
+	valuetype_t oldtype=VT_EMPTY;
+	double oldnumber=0;
+};
+
+//The dependencies of a cell that changed since the cell was last updated, as
+//passed to Cell::update; complete is false if others may have changed as well
+struct ChangeList{
+	const ValueChange *changes;
+	size_t size;
+	bool complete;
+};
 
 class CellArray{
-	vector<vector<Cell>> cells;
+	unordered_map<uint64_t,unique_ptr<CellTile>> tiles;
+	unsigned int w=0,h=0;
+
+	//indices of the columns referenced by enough long ranges, and the number
+	//of such ranges per column
+	unordered_map<unsigned int,ColumnIndex> columnindices;
+	unordered_map<unsigned int,unsigned int> columnrefs;
+
+	//the values of all cells, and the strings among them; after tiles, so that
+	//the tiles of the old array are gone before these when it is assigned to
+	unique_ptr<Slab> values=make_unique<Slab>();
+	unique_ptr<StringPool> strings=make_unique<StringPool>();
+
+	static uint64_t tileKey(CellAddress addr) noexcept;
+
+	//returns the tile containing addr, allocating it if needed
+	CellTile& tileFor(CellAddress addr);
+
+	//recomputes the block containing addr in the index of its column, if any
+	void updateIndex(CellAddress addr);
+	//(re)creates the index of a column, unless the sheet is too tall for it
+	void buildIndex(unsigned int column);
+
+	//clears the stale and dirty flags of addr, which is in tile
+	static void clearStale(CellTile &tile,CellAddress addr) noexcept;
+
+	//the totals of the block of a ColumnIndex containing addr
+	ColumnIndex::Totals blockTotals(CellAddress addr) const noexcept;
+
+	//adds the totals of a range; `what` is a combination of the AG_* flags in
+	//spreadsheet.cpp, and the other totals are left alone
+	void aggregate(CellRange range,unsigned int what,ColumnIndex::Totals &totals) const noexcept;
+	void aggregateSpans(CellRange range,unsigned int what,
+	                    ColumnIndex::Totals &totals) const noexcept;
+	void aggregateIndexed(const ColumnIndex &index,unsigned int column,
+	                      unsigned int fromrow,unsigned int torow,
+	                      unsigned int what,ColumnIndex::Totals &totals) const noexcept;
 
 public:
 	using const_iterator = CellArrayIt;
 
+	CellArray()=default;
+	CellArray(CellArray&&)=default;
+	CellArray& operator=(CellArray&&)=default;
+	~CellArray() noexcept;
+
 	class RangeWrapper{
 		const CellArray *cells;
 		CellRange range;
@@ -43,27 +128,122 @@ public:
 		CellArray::const_iterator end() const noexcept;
 	};
 
+	class SpanWrapper{
+		const CellArray *cells;
+		CellRange range;
+
+	public:
+		SpanWrapper(const CellArray &cells,CellRange range) noexcept;
+
+		CellArraySpanIt begin() const noexcept;
+		CellArraySpanIt end() const noexcept;
+	};
+
+	//the number of allocated tiles
+	size_t tileCount() const noexcept;
+
+	//the extent of the sheet area in use, as set by ensureSize/resize;
+	//cells outside of it are always empty
 	unsigned int width() const noexcept;
 	unsigned int height() const noexcept;
 
-	Cell& operator[](CellAddress addr) noexcept; //unsafe element access
+	//unsafe element access; the non-const version allocates the cell's tile
+	Cell& operator[](CellAddress addr) noexcept;
 	const Cell& operator[](CellAddress addr) const noexcept;
-	Cell& at(CellAddress addr); //throws on out-of-bounds using vector::at
+	Cell& at(CellAddress addr); //throws out_of_range on out-of-bounds
+
+	//returns the tile containing addr, or nullptr if it wasn't allocated
+	const CellTile* findTile(CellAddress addr) const noexcept;
+
+	//the Slab holding the values of the cells; allocating from it is
+	//thread-safe, so it may be used while cells are updated in parallel
+	Slab& valueSlab() const noexcept;
+	//the StringPool holding the strings of the cells; likewise thread-safe
+	StringPool& stringPool() const noexcept;
+
+	//Mutators of cell values; these keep the typed values of the cells in
+	//sync, so cell values should only be changed through these.
+	void setEditString(CellAddress addr,string s);
+	void setError(CellAddress addr,string_view errString);
+	//updates the cell, using possibly changed values of its dependencies
+	bool update(CellAddress addr);
+	//re-reads the typed value of the cell from its Cell
+	bool publish(CellAddress addr);
+	//(both return whether the typed value changed)
+
+	//The topological level of a cell in the dependency graph, as maintained by
+	//Spreadsheet; maxLevel returns an upper bound of the levels in a range.
+	unsigned int level(CellAddress addr) const noexcept;
+	void setLevel(CellAddress addr,unsigned int level);
+	unsigned int maxLevel(CellRange range) const noexcept;
+
+	//Whether the value of a cell may be out of date, in the lazy and manual
+	//calculation modes of Spreadsheet; a dirty cell is stale, and certainly
+	//needs updating. update(), publish() and setError() make a cell current
+	//again, as does clearStale(). markStale and markDirty return whether the
+	//cell wasn't stale yet.
+	bool isStale(CellAddress addr) const noexcept;
+	bool isDirty(CellAddress addr) const noexcept;
+	bool markStale(CellAddress addr);
+	bool markDirty(CellAddress addr);
+	void clearStale(CellAddress addr) noexcept;
+	//append the stale cells in the range, or in the whole array, to out
+	void staleCells(CellRange range,vector<CellAddress> &out) const;
+	void staleCells(vector<CellAddress> &out) const;
+
+	//appends the non-empty cells of the whole array to out, in no particular
+	//order; only allocated tiles are visited
+	void filledCells(vector<CellAddress> &out) const;
+
+	//The typed value of a cell, as of its last change. The number is 0 for
+	//non-number cells; the string is empty for non-string cells, and only
+	//valid until the cell changes.
+	valuetype_t valueType(CellAddress addr) const noexcept;
+	double numberValue(CellAddress addr) const noexcept;
+	string_view stringValue(CellAddress addr) const noexcept;
+	//both of the above in one lookup; returns the type, and sets number
+	valuetype_t numberAndType(CellAddress addr,double &number) const noexcept;
+
+	//the sum of the numbers in a range; if inexact isn't nullptr, it is set to
+	//the number of those that aren't exact integers (see aggregate.h)
+	double sum(CellRange range,size_t *inexact=nullptr) const noexcept;
+	//the number of non-empty cells in a range
+	size_t count(CellRange range) const noexcept;
+
+	//Spreadsheet reports every range dependency it attaches or detaches here.
+	//A column referenced by enough long ranges gets a ColumnIndex,
+	//which is kept until no such ranges are left.
+	void addRangeReference(CellRange range);
+	void removeRangeReference(CellRange range);
 
 	void ensureSize(unsigned int w,unsigned int h); //only resizes up if needed
 	void resize(unsigned int w,unsigned int h); //can forcibly resize down
 
 	RangeWrapper range(CellRange r) const noexcept; //iterator provider
 	//this skips cells that are out of range
+
+	//provides the values in the range as spans; empty and unallocated cells
+	//may be skipped, and the order of spans is unspecified
+	SpanWrapper spans(CellRange r) const noexcept;
 };
 
-class CellArrayIt : public iterator<input_iterator_tag,Cell*>{
+class CellArrayIt{
 	const CellArray *cells;
 	CellAddress begin,end,cursor;
 	bool isend;
+	const CellTile *tile; //tile containing cursor
 
 	CellArrayIt() noexcept; //end constructor
+
+	//moves cursor forward to the first cell at or after it in an allocated tile
+	void skipAbsent() noexcept;
 public:
+	using iterator_category=input_iterator_tag;
+	using value_type=Cell*;
+	using difference_type=ptrdiff_t;
+	using pointer=Cell**;
+	using reference=Cell*&;
+
 	CellArrayIt(const CellArray &cells,CellRange r) noexcept;
 
 	static CellArrayIt endit() noexcept; //returns the special end iterator
@@ -75,62 +255,193 @@ public:
 	CellArrayIt& operator++() noexcept;
 };
 
+class CellArraySpanIt{
+	const CellArray *cells;
+	CellRange range;
+	CellAddress tileorigin; //origin of the current tile
+	unsigned int column; //current column, in sheet coordinates
+	bool isend;
+	const CellTile *tile;
+	ValueSpan span;
+
+	CellArraySpanIt() noexcept; //end constructor
+
+	//moves to the first allocated tile at or after tileorigin
+	void findTile() noexcept;
+	//sets span from the current position
+	void makeSpan() noexcept;
+
+public:
+	using iterator_category=input_iterator_tag;
+	using value_type=ValueSpan;
+	using difference_type=ptrdiff_t;
+	using pointer=ValueSpan*;
+	using reference=ValueSpan&;
+
+	CellArraySpanIt(const CellArray &cells,CellRange r) noexcept;
+
+	static CellArraySpanIt endit() noexcept; //returns the special end iterator
+
+	bool operator==(const CellArraySpanIt &other) const noexcept;
+	bool operator!=(const CellArraySpanIt &other) const noexcept;
+	const ValueSpan& operator*() const;
+	const ValueSpan* operator->() const;
+	CellArraySpanIt& operator++() noexcept;
+};
+
+//How edits reach the cells that depend on them: in CM_AUTOMATIC, these are
+//recalculated right away; in CM_LAZY, they are only marked stale, and
+//evaluated once their value is read; in CM_MANUAL, edited cells are evaluated
+//right away, but stale cells keep their old value until
+//Spreadsheet::recalculateStale().
+enum calcmode_t{
+	CM_AUTOMATIC,
+	CM_LAZY,
+	CM_MANUAL
+};
+
 class Spreadsheet{
 	CellArray cells;
 
+	//dependencies on single cells, and on ranges
+	DependencyGraph celldeps;
+	RangeIndex rangedeps;
+
+	//cells whose dependencies would close a cycle, and so aren't attached,
+	//each with the cells on one such cycle; only an edit of one of those can
+	//break it, so a cell is only retried then. circularvia indexes the cells
+	//by those on their cycle.
+	map<CellAddress,vector<CellAddress>> circular;
+	unordered_multimap<CellAddress,CellAddress> circularvia;
+
+	//cells edited in the current transaction, in order of first edit, and
+	//their values before that; their dependencies aren't attached yet
+	bool intransaction=false;
+	vector<CellAddress> pending;
+	vector<ValueChange> pendingold;
+	unordered_set<CellAddress> pendingset;
+
 	bool changedSinceSave=false;
 
-	//reverse dependencies outside of allocated area
-	//key is cell that is depended on by the value
-	unordered_map<CellAddress,set<CellAddress>> revdepsOutside;
+	calcmode_t calcmode=CM_AUTOMATIC;
 
 	unsigned int getWidth() const noexcept; //return dimensions of `cells`
 	unsigned int getHeight() const noexcept;
-	bool inBounds(CellAddress addr) const noexcept; //whether addr is in bounds
-
-	//returns all cells updated, including given cell (only updated if
-	//updatefirst)
-	//if circular references and circularrefs!=nullptr, sets that to true, else
-	//to false;  if circularrefs==nullptr, ignores a circular reference and
-	//continues updating the rest
-	//Assumes addr in bounds!
-	set<CellAddress> recursiveUpdate(CellAddress addr,
-		                             bool *circularrefs,
-		                             bool updatefirst) noexcept;
+	bool inBounds(CellAddress addr) const noexcept; //whether addr is addressable
+
+	//updates all cells that depend (transitively) on the seeds, each at most
+	//once and after all of its dependencies. The seeds in `evaluate` are
+	//updated themselves as well; those in `preset` were already given their
+	//value by the caller. A cell is only updated if one of its dependencies
+	//changed value, so propagation stops at cells whose value stays the same.
+	//oldvalues has the values of seeds from before the caller changed them,
+	//where known; cells depending on other seeds don't get a complete
+	//ChangeList. Returns the seeds and all cells whose value changed.
+	set<CellAddress> recalculate(const vector<CellAddress> &evaluate,
+	                             const vector<CellAddress> &preset,
+	                             const vector<ValueChange> &oldvalues) noexcept;
+
+	//what recalculate does outside CM_AUTOMATIC: marks the seeds in evaluate,
+	//and the cells directly depending on any seed, as dirty, and the cells
+	//depending on those as stale. A stale cell only has stale dependents, so
+	//the marking stops at those. Returns the seeds and the cells newly marked.
+	set<CellAddress> invalidate(const vector<CellAddress> &evaluate,
+	                            const vector<CellAddress> &preset) noexcept;
+
+	//brings the given stale cells up to date, in order of level: a dirty cell
+	//is updated, and if its value changes, the cells directly depending on it
+	//become dirty; the others just become current. The given cells must
+	//include the stale cells they depend on. Cells of the same level are
+	//independent, so they are updated in parallel when there are enough of
+	//them. Returns the cells whose value changed.
+	set<CellAddress> refresh(const vector<CellAddress> &stale) noexcept;
+
+	//in CM_LAZY, if the cell is stale, brings it and the stale cells it
+	//depends on up to date
+	void evaluateStale(CellAddress addr) noexcept;
+	//brings the stale cells among the given ones up to date, with the stale
+	//cells they depend on, in any calculation mode; returns the cells changed
+	set<CellAddress> refreshStale(const vector<CellAddress> &addrs) noexcept;
+
+	//attaches the dependencies of the pending cells (or marks them as
+	//circular), then recalculates everything affected in one pass; clears
+	//pending and returns cells changed
+	set<CellAddress> commitPending() noexcept;
 
 	//assumes given cell contains an error value, then propagates that through
 	//its reverse dependencies; returns cells changed
 	set<CellAddress> propagateError(CellAddress addr) noexcept;
 
-	//checks whether the dep chain starting from addr contains a cycle
-	//the second method should not be used directly; the first calls the second
-	bool checkCircularDependencies(CellAddress addr) noexcept;
-	bool checkCircularDependencies(CellAddress addr,set<CellAddress> &seen) noexcept;
+	//The dependency graph is kept acyclic, with a topological level for every
+	//cell: a cell's level is higher than those of all its dependencies.
+	//Before attaching new dependencies to dest, this sets the level of dest
+	//above them, and raises the levels of the cells depending on dest where
+	//needed. Only the cells whose level changes are visited.
+	void updateLevels(CellAddress dest,const Dependencies &deps);
 
-	void attachRevdeps(const vector<CellAddress> &depaddrs,CellAddress dest) noexcept;
-	void detachRevdeps(const vector<CellAddress> &depaddrs,CellAddress dest) noexcept;
+	//returns whether attaching deps to dest would close a cycle, i.e. whether
+	//one of them depends on dest; if so, sets path to the cells on such a
+	//cycle, from a dependent of dest to the dependency. Cells on the way have
+	//a lower level than the dependency, so only those are visited, and the
+	//levels aren't changed.
+	bool findCycle(CellAddress dest,const Dependencies &deps,vector<CellAddress> &path) const;
 
-public:
-	Spreadsheet(unsigned int width,unsigned int height);
+	//add a cell to, or remove it from, `circular`; remove returns whether the
+	//cell was there
+	void addCircular(CellAddress addr,const vector<CellAddress> &path);
+	bool removeCircular(CellAddress addr) noexcept;
+
+	//attaches the cells in `circular` whose cycle was broken by editing the
+	//given cells, and updates them; returns cells changed
+	set<CellAddress> retryCircular(const vector<CellAddress> &edited) noexcept;
 
+	//appends all cells that directly depend on addr to out, sorted and
+	//without duplicates
+	void collectDependents(CellAddress addr,vector<CellAddress> &out) const;
+
+	void attachRevdeps(const Dependencies &deps,CellAddress dest) noexcept;
+	void detachRevdeps(const Dependencies &deps,CellAddress dest) noexcept;
+
+public:
 	//functions for saving and loading to/from files;
 	//return whether successful
 	bool saveToDisk(string fname);
 	bool loadFromDisk(string fname);
 
-	//gets display string for that cell (Nothing if out of bounds)
+	//The sheet is logically unbounded: cells that were never written to are
+	//empty, and reading them doesn't allocate anything.
+
+	//gets display string for that cell (Nothing if not addressable); in
+	//CM_LAZY, this evaluates the cell first if it is stale
 	Maybe<string> getCellDisplayString(CellAddress addr) noexcept;
-	//gets the raw cell data (for editing) (Nothing if out of bounds)
-	Maybe<string> getCellEditString(CellAddress addr) noexcept;
+	//the display string in at most width characters: numbers are rounded to
+	//fit, other strings are cut off (Nothing if not addressable)
+	Maybe<string> getCellDisplayString(CellAddress addr,size_t width) noexcept;
+	//gets the raw cell data (for editing) (Nothing if not addressable)
+	Maybe<string> getCellEditString(CellAddress addr) const noexcept;
 
 	//changes the raw cell data of a cell, returns list of cells changed in
-	//sheet (includes edited cell); (Nothing if out of bounds)
+	//sheet (includes edited cell); (Nothing if not addressable)
+	//Within a transaction, returns an empty set instead.
 	Maybe<set<CellAddress>> changeCellValue(CellAddress addr,string repr) noexcept;
 
-	//ensures that the sheet is at least the given size;
-	//useful for safe querying
-	void ensureSheetSize(unsigned int width,unsigned int height);
+	//Transactions batch many edits: changeCellValue only stores the new raw
+	//data, and the values of the sheet aren't updated until commitTransaction,
+	//which rewires the dependencies, checks for cycles and recalculates once
+	//for all edits together. It returns all cells changed by the transaction.
+	void beginTransaction() noexcept;
+	set<CellAddress> commitTransaction() noexcept;
+	bool inTransaction() const noexcept;
 
 	//returns whether the sheet has changed since last saveToDisk
 	bool isClobbered() const noexcept;
+
+	//the number of tiles of cells allocated, a measure of memory use
+	size_t tileCount() const noexcept;
+
+	//switching to CM_AUTOMATIC recalculates all stale cells
+	void setCalcMode(calcmode_t mode) noexcept;
+	calcmode_t getCalcMode() const noexcept;
+	//brings all stale cells up to date; returns the cells changed
+	set<CellAddress> recalculateStale() noexcept;
 };
@@ -0,0 +1,82 @@
+#include "stringpool.h"
+
+using namespace std;
+
+StringPool::Entry& StringPool::entry(uint32_t handle) const noexcept {
+	//handle+FIRST_SIZE has its top bit at FIRST_SHIFT+k for block k
+	const uint32_t v=handle+FIRST_SIZE;
+	const unsigned int k=31-__builtin_clz(v)-FIRST_SHIFT;
+	return blocks[k][v-(FIRST_SIZE<<k)];
+}
+
+uint32_t StringPool::add(string_view s){
+	if(!shared)return addUnlocked(s);
+	lock_guard<mutex> guard(lock);
+	return addUnlocked(s);
+}
+
+uint32_t StringPool::addUnlocked(string_view s){
+	auto it=index.find(s);
+	if(it!=index.end()){
+		entry(it->second).refs++;
+		return it->second;
+	}
+	uint32_t handle;
+	if(freelist.size()){
+		handle=freelist.back();
+		freelist.pop_back();
+	} else {
+		handle=count;
+		const uint32_t v=handle+FIRST_SIZE;
+		if((v&(v-1))==0){ //first entry of a new block
+			const unsigned int k=31-__builtin_clz(v)-FIRST_SHIFT;
+			blocks[k].reset(new Entry[FIRST_SIZE<<k]);
+		}
+		count++;
+	}
+	Entry &e=entry(handle);
+	e.str.assign(s);
+	e.refs=1;
+	index.emplace(string_view(e.str),handle);
+	return handle;
+}
+
+void StringPool::retain(uint32_t handle) noexcept {
+	if(!shared){
+		entry(handle).refs++;
+		return;
+	}
+	lock_guard<mutex> guard(lock);
+	entry(handle).refs++;
+}
+
+void StringPool::release(uint32_t handle) noexcept {
+	if(!shared){
+		releaseUnlocked(handle);
+		return;
+	}
+	lock_guard<mutex> guard(lock);
+	releaseUnlocked(handle);
+}
+
+void StringPool::releaseUnlocked(uint32_t handle) noexcept {
+	Entry &e=entry(handle);
+	if(--e.refs>0)return;
+	index.erase(string_view(e.str));
+	e.str.clear();
+	e.str.shrink_to_fit();
+	freelist.push_back(handle);
+}
+
+string_view StringPool::get(uint32_t handle) const noexcept {
+	return entry(handle).str;
+}
+
+void StringPool::reserve(size_t n){
+	lock_guard<mutex> guard(lock);
+	index.reserve(n);
+}
+
+void StringPool::setShared(bool shared) noexcept {
+	this->shared=shared;
+}
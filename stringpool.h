@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+using namespace std;
+
+/*
+An interning store for the strings of a sheet: text cells, error messages,
+and the typed value lanes of CellTile, which refer to string values with a
+fixed-size entry. Equal strings share one reference counted entry with a
+stable handle, so that repeated labels and errors are stored once, and two
+handles are equal exactly if their strings are. Handles of released strings
+are reused by later additions.
+Entries live in blocks of doubling size that are never moved, so that get()
+needs no lock and the views it returns stay valid until their handle is
+released. Adding and releasing are thread-safe, since cells may be regenerated
+during a parallel recalculation; a pool that no other thread can see yet, like
+that of a sheet being loaded, can skip the locking with setShared(false).
+*/
+
+class StringPool{
+	static const unsigned int FIRST_SHIFT=6;
+	static const uint32_t FIRST_SIZE=1<<FIRST_SHIFT; //entries in the first block
+	static const unsigned int NBLOCKS=32-FIRST_SHIFT;
+
+	struct Entry{
+		string str;
+		uint32_t refs=0;
+	};
+
+	unique_ptr<Entry[]> blocks[NBLOCKS]; //block k has FIRST_SIZE<<k entries
+	uint32_t count=0; //handles given out so far
+	unordered_map<string_view,uint32_t> index; //keys point into the entries
+	vector<uint32_t> freelist;
+	mutex lock;
+	bool shared=true; //whether to lock
+
+	Entry& entry(uint32_t handle) const noexcept;
+
+	//add and release, with lock held if needed
+	uint32_t addUnlocked(string_view s);
+	void releaseUnlocked(uint32_t handle) noexcept;
+
+public:
+	StringPool() noexcept=default;
+	StringPool(const StringPool&)=delete;
+	StringPool& operator=(const StringPool&)=delete;
+
+	//returns the handle of the string, storing it if it isn't present yet;
+	//every add() must be matched by a release()
+	uint32_t add(string_view s);
+
+	//adds another reference to the string of handle
+	void retain(uint32_t handle) noexcept;
+
+	//drops a reference to the string; once none are left, the handle may be
+	//returned by a later add()
+	void release(uint32_t handle) noexcept;
+
+	string_view get(uint32_t handle) const noexcept;
+
+	//makes room for n distinct strings, so that adding them doesn't rehash
+	void reserve(size_t n);
+
+	//whether other threads may use the pool at the same time, which is the
+	//default; if not, adding and releasing don't lock
+	void setShared(bool shared) noexcept;
+};
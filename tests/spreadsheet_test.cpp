@@ -0,0 +1,985 @@
+#include "../spreadsheet.h"
+#include "../formula.h"
+#include "../jit.h"
+#include "../threadpool.h"
+#include "../conversion.h"
+#include "../numberformat.h"
+#include "../util.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstring>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+#include <unistd.h>
+
+using namespace std;
+
+static int failures=0;
+
+#define CHECK(cond) do{ \
+	if(!(cond)){ \
+		cerr<<__FILE__<<":"<<__LINE__<<": check failed: "#cond<<endl; \
+		failures++; \
+	} \
+}while(0)
+
+static string display(Spreadsheet &sheet,CellAddress addr){
+	return sheet.getCellDisplayString(addr).fromJust();
+}
+
+static CellAddress cellAt(const string &repr){
+	return CellAddress::fromRepresentation(repr).fromJust();
+}
+
+static void setCell(Spreadsheet &sheet,const string &repr,const string &value){
+	sheet.changeCellValue(cellAt(repr),value);
+}
+
+static string display(Spreadsheet &sheet,const string &repr){
+	return display(sheet,cellAt(repr));
+}
+
+//a deterministic pseudo-random number
+static unsigned int nextRandom(unsigned int &seed){
+	seed=seed*1103515245+12345;
+	return seed>>8;
+}
+
+//the values of two evaluations are the same, including NaN's and the sign
+//of zero
+static bool sameResult(valuetype_t type1,double number1,valuetype_t type2,double number2){
+	if(type1!=type2)return false;
+	if(type1!=VT_NUMBER)return true;
+	if(std::isnan(number1))return std::isnan(number2);
+	return memcmp(&number1,&number2,sizeof(double))==0;
+}
+
+//a file name for the tests to use, removed again by the caller
+static string tempFile(){
+	return "/tmp/spreadsheet_test."+to_string(getpid())+".sheet";
+}
+
+static size_t fileSize(const string &fname){
+	ifstream in(fname,ios::binary|ios::ate);
+	return in.tellg();
+}
+
+static void testNumberFormat(){
+	char buf[NUMBER_BUFSIZE];
+	static const struct{double v;const char *shown;} shortest[]={
+		{0,"0"},{-0.0,"-0"},{0.1,"0.1"},{0.1+0.2,"0.30000000000000004"},{1/3.0,"0.3333333333333333"},
+		{-2.5,"-2.5"},{123456,"123456"},{100000,"1e+05"},{1e15,"1e+15"},{1e16,"1e+16"},
+		{1234567890123456,"1234567890123456"},{1152921504606846976.0,"1152921504606846976"},
+		{1e-4,"1e-04"},{1e-5,"1e-05"},{-1e-5,"-1e-05"},
+		{1.234567e-5,"1.234567e-05"},{5e-324,"5e-324"},{1.7976931348623157e308,"1.7976931348623157e+308"},
+		{NAN,"NaN"},{INFINITY,"inf"},{-INFINITY,"-inf"},
+	};
+	for(const auto &c : shortest){
+		CHECK(string(buf,formatNumber(c.v,buf))==c.shown);
+	}
+	CHECK(string(buf,formatNumber(INT_MIN,buf))=="-2147483648");
+	CHECK(string(buf,formatNumber(0,buf))=="0");
+
+	static const struct{double v;int decimals;const char *shown;} fixed[]={
+		{3.14159,2,"3.14"},{-3.14159,3,"-3.142"},{2.5,0,"2"},{3.5,0,"4"},{-1.005,2,"-1.00"},
+		{1e-5,2,"0.00"},{-1e-5,2,"-0.00"},{123456,2,"123456.00"},{1e15,1,"1000000000000000.0"},
+		//too long for the buffer, so shortest
+		{1e300,2,"1e+300"},{NAN,2,"NaN"},{INFINITY,2,"inf"},{-INFINITY,0,"-inf"},
+	};
+	for(const auto &c : fixed){
+		CHECK(string(buf,formatFixed(c.v,c.decimals,buf))==c.shown);
+	}
+
+	static const struct{double v;size_t width;const char *shown;} fitted[]={
+		//shortest if it fits
+		{0,8,"0"},{-2.5,8,"-2.5"},{0.1+0.2,8,"0.3"},{100000,8,"1e+05"},{1e15,8,"1e+15"},
+		{1e-5,8,"1e-05"},{-1e-5,8,"-1e-05"},{NAN,8,"NaN"},{INFINITY,8,"inf"},{-INFINITY,8,"-inf"},
+		//else fixed with fewer decimals
+		{1/3.0,8,"0.333333"},{3.14159265,8,"3.141593"},{-3.14159265,8,"-3.14159"},
+		{12345678.9,8,"12345679"},{0.00012345678,8,"0.000123"},{-0.000123456,8,"-0.00012"},
+		{3.14159265,3,"3.1"},{-2.5,3,"-2"},{-3.14159265,2,"-3"},
+		//else scientific, also where fixed would leave no significant digits
+		{123456789,8,"1.23e+08"},{-123456789,8,"-1.2e+08"},{99999999.5,8,"1.00e+08"},
+		{1234567890123456,8,"1.23e+15"},{1.234567e-5,8,"1.23e-05"},{-1.5e-300,8,"-2e-300"},
+		{1.7976931348623157e308,8,"1.8e+308"},
+		//else filled with #
+		{123456,3,"###"},{1e-5,3,"###"},{-INFINITY,3,"###"},{0.5,2,"##"},{NAN,2,"##"},
+	};
+	for(const auto &c : fitted){
+		const string shown(buf,formatFitted(c.v,c.width,buf));
+		if(shown!=c.shown){
+			cerr<<c.v<<" in width "<<c.width<<" is \""<<shown<<"\" instead of \""<<c.shown<<"\""<<endl;
+			failures++;
+		}
+	}
+
+	//random doubles read back exactly, are no longer than the shortest %g
+	//that does, and fit the width they are given
+	unsigned int seed=3;
+	for(int i=0;i<20000;i++){
+		double v;
+		if(i%2){
+			const uint64_t bits=(uint64_t)nextRandom(seed)<<40^(uint64_t)nextRandom(seed)<<16^nextRandom(seed);
+			memcpy(&v,&bits,sizeof v);
+			if(!std::isfinite(v))continue;
+		} else v=(int)(nextRandom(seed)%2000001-1000000)/pow(10,nextRandom(seed)%12);
+		const string shown(buf,formatNumber(v,buf));
+		CHECK(sameResult(VT_NUMBER,strtod(shown.c_str(),nullptr),VT_NUMBER,v));
+		for(int precision=1;precision<=17;precision++){
+			snprintf(buf,sizeof buf,"%.*g",precision,v);
+			if(strtod(buf,nullptr)==v){
+				CHECK(shown.size()<=strlen(buf));
+				break;
+			}
+		}
+		const size_t width=1+nextRandom(seed)%12;
+		const string fit(buf,formatFitted(v,width,buf));
+		CHECK(fit.size()<=width);
+		if(fit[0]!='#'){
+			char *end;
+			strtod(fit.c_str(),&end);
+			CHECK(*end==0);
+		} else CHECK(fit==string(width,'#'));
+	}
+}
+
+//the number classification of edit strings before parseNumber: stoi with
+//base 0, else stod, with out of range doubles as inf
+static numberkind_t convertOld(const string &s,int &intval,double &doubleval){
+	const string trimmed=trimright(s);
+	size_t endpos;
+	try {
+		intval=stoi(trimmed,&endpos,0);
+		if(endpos==trimmed.size())return NK_INT;
+	} catch(const invalid_argument&){
+	} catch(const out_of_range&){
+	}
+	try {
+		doubleval=stod(trimmed,&endpos);
+		return endpos==trimmed.size()?NK_DOUBLE:NK_NONE;
+	} catch(const invalid_argument&){
+		return NK_NONE;
+	} catch(const out_of_range&){
+		doubleval=1/0.0;
+		return NK_DOUBLE;
+	}
+}
+
+static bool sameClassification(const string &s){
+	int int1=0,int2=0;
+	double double1=0,double2=0;
+	const numberkind_t kind1=parseNumber(s,int1,double1),kind2=convertOld(s,int2,double2);
+	if(kind1!=kind2)return false;
+	if(kind1==NK_INT)return int1==int2;
+	if(kind1==NK_DOUBLE)return sameResult(VT_NUMBER,double1,VT_NUMBER,double2);
+	return true;
+}
+
+//edit strings are classified as numbers exactly as before
+static void testParseNumber(){
+	static const char *const cases[]={
+		"","  ","0","7","-7","+7","--7","+-7","-+7","007","0.","1.","-.5",".","-.","+.e1",
+		"1e5","1E5","1e","1e+","1e-3","1e+3","1.5e-3","-0","-0.0","00","08","09.5","012","-012",
+		//hexadecimal, for ints and for doubles
+		"0x","0x1A","0X1a","-0x10","0x1g","0x1.8p1","0x1p-2","0x.8","0xp1","0x1p","0x1p+-2",
+		"0x7fffffff","0x80000000","-0x80000000","0xffffffffffffffffff",
+		//whitespace on either side, and trailing garbage
+		" 12","12 ","\t12\n"," 1.5 ","1 2","12abc","1.5x","1e5e5","1,5","1_000","- 5","5-",
+		//the limits of int
+		"2147483647","2147483648","-2147483648","-2147483649","99999999999999999999",
+		"017777777777","020000000000",
+		//inf and nan, and doubles out of range
+		"inf","-inf","+inf","INF","Infinity","infinity","infinit","in","nan","-nan","NaN",
+		"nan(123)","nan(","infx","1e308","1e309","-1e309","1e-320","1e-400","-1e-400",
+		"4.9e-324","2.5e-324","0x1p-1074","0x1.8p-1070","2.2250738585072009e-308",
+		"2.2250738585072014e-308","1.7976931348623157e308","1.7976931348623159e308",
+		"text","e5","x12","i","n",
+	};
+	for(const char *c : cases){
+		if(!sameClassification(c)){
+			cerr<<"\""<<c<<"\" is classified differently from stoi/stod"<<endl;
+			failures++;
+		}
+	}
+	//and short strings of the characters that matter
+	static const char alphabet[]="0127x.e+-p infa\t";
+	unsigned int seed=5;
+	for(int i=0;i<50000;i++){
+		string str;
+		for(unsigned int n=nextRandom(seed)%7;n>0;n--){
+			str+=alphabet[nextRandom(seed)%(sizeof(alphabet)-1)];
+		}
+		if(!sameClassification(str)){
+			cerr<<"\""<<str<<"\" is classified differently from stoi/stod"<<endl;
+			failures++;
+		}
+	}
+}
+
+//formulas evaluate as the original parser did, and their edit strings come
+//back exactly as typed
+static void testFormulaParsing(){
+	static const char *const cases[][2]={
+		//precedence and associativity; ^ is right associative
+		{"=1+2*3","7"},{"=(1+2)*3","9"},{"=1-2+3","2"},{"=8-3-2","3"},{"=64/4/2","8"},
+		{"=7%4*3","9"},{"=2*3%4","2"},{"=2^3^2","512"},
+		//unary minus binds less tightly than ^, but a minus sign before a
+		//number is part of the number
+		{"=-2^2","4"},{"=(-2)^2","4"},{"=2^-1","0.5"},{"=1--1","2"},{"=--2","2"},
+		{"=-A1","-2"},{"=- A1","-2"},{"=3*-A2","-9"},{"=-(A1+A2)","-5"},
+		{"=-A1^2","-4"},{"=-(2)^2","-4"},{"=2*-A1^2","-8"},{"=-A1*-A2","6"},
+		//string literals, with either quote and escapes
+		{"=\"hello\"","hello"},{"='single'","single"},{"=\"a\\\"b\"","a\"b"},
+		{"=\"x\"+1","FERR:Error in formula dependencies"},
+		//addresses that don't round-trip still refer to the right cell
+		{"=A01","2"},{"=A01+B001","12"},{"=A1+A01","4"},{"=SUM(A01:A02)","5"},
+		{"=SUM(A2:A1)","5"},{"= A1 + 1 ","3"},{"=1.5e-1*2","0.3"},{"=1/0","inf"},
+		{"=SUM(A1:B1)+COUNT(A1:A2)","14"},{"=AVG(A1:A2)","2.5"},{"=SUM(A1)","2"},
+		//errors
+		{"=(1+2","ERR:Invalid formula: Not enough arguments to operator (?"},
+		{"=((A1)","ERR:Invalid formula: Not enough arguments to operator (?"},
+		{"=1+2)","ERR:Invalid formula: Excess closing parenthesis"},
+		{"=()","ERR:Invalid formula: 0 values?"},
+		{"=1 2","ERR:Invalid formula: 2 values?"},
+		{"=1+","ERR:Invalid formula: Not enough arguments to operator +?"},
+		{"=*2","ERR:Invalid formula: Not enough arguments to operator *?"},
+		{"=\"abc","ERR:Invalid formula: String not closed with a quote"},
+		{"=a1","ERR:Invalid formula: Invalid character 'a' in formula"},
+		{"=FOO(A1:A2)","ERR:Invalid formula: Unknown function FOO"},
+		{"=AA","ERR:Invalid formula: Unterminated function call"},
+		{"=A1:A2","ERR:Invalid formula: Range outside of function call"},
+	};
+	Spreadsheet sheet;
+	setCell(sheet,"A1","2");
+	setCell(sheet,"A2","3");
+	setCell(sheet,"B1","10");
+	for(const auto &c : cases){
+		setCell(sheet,"D5",c[0]);
+		if(display(sheet,"D5")!=c[1]){
+			cerr<<c[0]<<" shows "<<display(sheet,"D5")<<" instead of "<<c[1]<<endl;
+			failures++;
+		}
+		CHECK(sheet.getCellEditString(cellAt("D5")).fromJust()==c[0]);
+	}
+}
+
+//a formula filled down a column is one Formula, resolved at every cell
+static void testFilledFormulaShared(){
+	const auto parse=[](const string &text,const string &anchor){
+		return Formula::parse(text,cellAt(anchor)).fromRight();
+	};
+	const shared_ptr<const Formula> first=parse("A1*2+SUM(A1:A3)","B1");
+	const shared_ptr<const Formula> second=parse("A2*2+SUM(A2:A4)","B2");
+	CHECK(first==second);
+	CHECK(first->getText(cellAt("B1"))=="A1*2+SUM(A1:A3)");
+	CHECK(first->getText(cellAt("B2"))=="A2*2+SUM(A2:A4)");
+	CHECK(first->getText(cellAt("C7"))=="B7*2+SUM(B7:B9)");
+	const Dependencies deps=first->getDependencies(cellAt("B2"));
+	CHECK(deps.cells.size()==1&&deps.cells[0]==cellAt("A2"));
+	CHECK(deps.ranges.size()==1&&deps.ranges[0].from==cellAt("A2")&&
+	      deps.ranges[0].to==cellAt("A4"));
+	//text that wouldn't come back from the offsets is kept as typed, for its
+	//own cell only
+	const shared_ptr<const Formula> padded=parse("A01*2+SUM(A1:A3)","B1");
+	CHECK(padded!=first);
+	CHECK(padded->getText(cellAt("B1"))=="A01*2+SUM(A1:A3)");
+	CHECK(parse("A01*2+SUM(A1:A3)","B2")!=padded);
+	CHECK(Formula::parse("A1*(2",cellAt("B1")).isLeft());
+
+	Spreadsheet sheet;
+	for(int row=1;row<=5;row++)setCell(sheet,"A"+to_string(row),to_string(row*row));
+	setCell(sheet,"B1","=A1*2+SUM(A1:A3)");
+	setCell(sheet,"B2","=A2*2+SUM(A2:A4)");
+	CHECK(display(sheet,"B1")=="16");
+	CHECK(display(sheet,"B2")=="37");
+	setCell(sheet,"A3","0");
+	CHECK(display(sheet,"B1")=="7");
+	CHECK(display(sheet,"B2")=="28");
+	CHECK(sheet.getCellEditString(cellAt("B2")).fromJust()=="=A2*2+SUM(A2:A4)");
+}
+
+//reading cells that were never written to doesn't allocate anything
+static void testReadDoesNotAllocate(){
+	for(calcmode_t mode : {CM_AUTOMATIC,CM_LAZY,CM_MANUAL}){
+		Spreadsheet sheet;
+		sheet.setCalcMode(mode);
+		sheet.changeCellValue(CellAddress(0,0),"1");
+		const size_t tiles=sheet.tileCount();
+		for(unsigned int row=0;row<20000;row+=7){
+			for(unsigned int column=0;column<10;column++){
+				CHECK(display(sheet,CellAddress(row,column))==(row||column?"":"1"));
+				sheet.getCellDisplayString(CellAddress(row,column),8);
+				sheet.getCellEditString(CellAddress(row,column));
+			}
+		}
+		CHECK(sheet.tileCount()==tiles);
+		sheet.changeCellValue(CellAddress(50000,50),"");
+		CHECK(sheet.tileCount()==tiles);
+	}
+}
+
+//a single long column of data only takes the tiles that column needs
+static void testTallColumnTiles(){
+	Spreadsheet sheet;
+	const unsigned int rows=100000;
+	sheet.beginTransaction();
+	for(unsigned int row=0;row<rows;row++)sheet.changeCellValue(CellAddress(row,0),to_string(row));
+	sheet.commitTransaction();
+	CHECK(sheet.tileCount()==(rows+CellTile::ROWS-1)/CellTile::ROWS);
+	sheet.changeCellValue(CellAddress(0,1),"=SUM(A1:A100000)");
+	CHECK(display(sheet,CellAddress(0,1))=="4999950000");
+}
+
+//in CM_MANUAL, an edited cell shows its new value right away, and only the
+//cells depending on it wait for recalculateStale
+static void testManualEvaluatesEdits(){
+	Spreadsheet sheet;
+	sheet.changeCellValue(CellAddress(0,0),"5");
+	sheet.changeCellValue(CellAddress(0,1),"=A1*2");
+	sheet.changeCellValue(CellAddress(0,2),"=B1+1");
+	sheet.setCalcMode(CM_MANUAL);
+	CHECK(display(sheet,CellAddress(0,1))=="10");
+	sheet.changeCellValue(CellAddress(0,1),"=A1*3");
+	CHECK(display(sheet,CellAddress(0,1))=="15");
+	CHECK(display(sheet,CellAddress(0,2))=="11");
+	sheet.changeCellValue(CellAddress(1,0),"=1+1");
+	CHECK(display(sheet,CellAddress(1,0))=="2");
+	sheet.changeCellValue(CellAddress(0,0),"7");
+	CHECK(display(sheet,CellAddress(0,1))=="15");
+	sheet.recalculateStale();
+	CHECK(display(sheet,CellAddress(0,1))=="21");
+	CHECK(display(sheet,CellAddress(0,2))=="22");
+}
+
+//saving writes only the non-empty cells, however far apart they are
+static void testSparseSaveLoad(){
+	const string fname=tempFile();
+	Spreadsheet sheet;
+	sheet.changeCellValue(CellAddress(0,0),"1");
+	sheet.changeCellValue(CellAddress::fromRepresentation("ZZ100000").fromJust(),"=A1+1");
+	CHECK(sheet.saveToDisk(fname));
+	CHECK(fileSize(fname)<100);
+	Spreadsheet loaded;
+	CHECK(loaded.loadFromDisk(fname));
+	CHECK(display(loaded,CellAddress(0,0))=="1");
+	CHECK(display(loaded,CellAddress(99999,701))=="2");
+	CHECK(loaded.getCellEditString(CellAddress(99999,701)).fromJust()=="=A1+1");
+	CHECK(display(loaded,CellAddress(50000,300))=="");
+	CHECK(loaded.tileCount()==2);
+	loaded.changeCellValue(CellAddress(0,0),"5");
+	CHECK(display(loaded,CellAddress(99999,701))=="6");
+	unlink(fname.c_str());
+}
+
+//files from before the sparse format, which store every cell, still load
+static void testDenseLoad(){
+	const string fname=tempFile();
+	{
+		ofstream out(fname);
+		writeUInt32LE(out,2); //width
+		writeUInt32LE(out,2); //height
+		writeUInt32LE(out,0); //reverse dependency lists
+		for(const string edit : {"3","","","=A1*2"}){
+			writeUInt32LE(out,0); //reverse dependencies of the cell
+			out<<(unsigned char)0;
+			writeUInt32LE(out,edit.size());
+			out<<edit;
+		}
+	}
+	Spreadsheet sheet;
+	CHECK(sheet.loadFromDisk(fname));
+	CHECK(display(sheet,CellAddress(0,0))=="3");
+	CHECK(display(sheet,CellAddress(1,1))=="6");
+	CHECK(display(sheet,CellAddress(0,1))=="");
+	unlink(fname.c_str());
+}
+
+//a random arithmetic formula over the cells A1:D4, with at most depth
+//levels of operators
+static string randomFormula(unsigned int &seed,int depth){
+	static const char *const calls[]={"SUM(A1:D4)","AVG(A1:B4)","COUNT(B2:D3)","SUM(C1:C4)"};
+	static const char *const numbers[]={"0","1","2","0.5","3","1e308"};
+	const unsigned int r=nextRandom(seed);
+	if(depth==0||r%5==0){
+		switch(nextRandom(seed)%3){
+			case 0: return numbers[nextRandom(seed)%6];
+			case 1: return string(1,'A'+nextRandom(seed)%4)+to_string(1+nextRandom(seed)%4);
+			default: return calls[nextRandom(seed)%4];
+		}
+	}
+	if(r%5==1)return "-"+randomFormula(seed,depth-1);
+	const string a=randomFormula(seed,depth-1),b=randomFormula(seed,depth-1);
+	const char op="+-*/%^"[nextRandom(seed)%6];
+	if(nextRandom(seed)%2)return "("+a+op+b+")";
+	return a+op+b;
+}
+
+//formulas give the same results compiled to native code as interpreted, for
+//all operators and for operands that are NaN, infinite or huge
+static void testNativeMatchesInterpreter(){
+	static const char *const values[]={"","0","1","-2","0.5","3.25","1e308","-1e308",
+	                                   "inf","-inf","nan","-0.0","1e-300","7"};
+	const unsigned int NVALUES=sizeof(values)/sizeof(values[0]);
+	const unsigned int SETS=16; //less than JIT_THRESHOLD
+	CellArray cells;
+	cells.resize(4,4);
+	const CellAddress anchor(10,10);
+	unsigned int seed=42;
+	for(int n=0;n<3000;n++){
+		//at least one operator, since a lone operand isn't compiled
+		const string text=randomFormula(seed,3)+"+-*/%^"[nextRandom(seed)%6]+randomFormula(seed,3);
+		Either<string,shared_ptr<const Formula>> parsed=Formula::parse(text,anchor);
+		if(parsed.isLeft()){
+			cerr<<"cannot parse "<<text<<": "<<parsed.fromLeft()<<endl;
+			failures++;
+			continue;
+		}
+		const shared_ptr<const Formula> formula=parsed.fromRight();
+		CHECK(!formula->isNative());
+		vector<unsigned int> sets;
+		vector<valuetype_t> types;
+		vector<double> numbers;
+		const auto evaluate=[&](unsigned int set,valuetype_t &type,double &number){
+			for(unsigned int i=0;i<16;i++){
+				cells.setEditString(CellAddress(i/4,i%4),values[(set>>i*2)%NVALUES]);
+			}
+			vector<Formula::CallState> states;
+			string str;
+			number=0;
+			type=formula->evaluate(cells,anchor,states,nullptr,number,str);
+		};
+		for(unsigned int k=0;k<SETS;k++){
+			sets.push_back(nextRandom(seed)*2654435761u);
+			types.emplace_back();
+			numbers.emplace_back();
+			evaluate(sets[k],types[k],numbers[k]);
+		}
+		valuetype_t type;
+		double number;
+		for(int k=0;k<64;k++)evaluate(sets[0],type,number);
+		CHECK(formula->isNative()==JitBuilder::available());
+		for(unsigned int k=0;k<SETS;k++){
+			evaluate(sets[k],type,number);
+			if(!sameResult(types[k],numbers[k],type,number)){
+				cerr<<text<<": interpreted "<<numbers[k]<<", native "<<number<<endl;
+				failures++;
+			}
+		}
+	}
+}
+
+//the code of destroyed formulas is freed, so its memory is used again
+static void testNativeCodeReleased(){
+	if(!JitBuilder::available())return;
+	//the address that new code goes to
+	const auto probe=[](){
+		JitBuilder builder;
+		builder.pushConstant(0,0);
+		const jitfunc_t func=builder.finish();
+		JitBuilder::release(func);
+		return func;
+	};
+	CellArray cells;
+	cells.setEditString(CellAddress(0,0),"3");
+	const jitfunc_t first=probe();
+	CHECK(first!=nullptr);
+	for(int n=0;n<3000;n++){
+		const CellAddress anchor(1,0);
+		shared_ptr<const Formula> formula=
+			Formula::parse("A1*A1+"+to_string(n)+"-A1/2",anchor).fromRight();
+		vector<Formula::CallState> states;
+		double number;
+		string str;
+		for(int k=0;k<70;k++)formula->evaluate(cells,anchor,states,nullptr,number,str);
+		CHECK(formula->isNative());
+		CHECK(number==n+7.5);
+		if(n==0)CHECK(probe()!=first); //the formula's code is in the way
+		formula.reset();
+	}
+	CHECK(probe()==first);
+}
+
+//aggregates updated by the changes of their range match those of a sheet
+//computed from scratch, as loading does, whatever the edits
+static void testAggregateDeltas(){
+	//mostly exact integers, text and empty cells, so that ranges go back and
+	//forth between holding only exact integers and not
+	static const char *const values[]={"","","1","-7","12","300","40000","5","text"};
+	static const char *const rare[]={"0.1","2.5","-0.3","1e17","inf","9007199254740993",
+	                                 "=A2+1","=B3/3"};
+	static const char *const formulas[]={"=SUM(A1:C40)","=COUNT(A1:C40)","=AVG(A1:B40)",
+	                                     "=SUM(A1:A40)+SUM(B5:C8)","=SUM(A1:C1200000)",
+	                                     "=COUNT(A1:C1200000)","=AVG(B1:B1200000)",
+	                                     "=SUM(E1:E3)*2","=COUNT(A1:A2)+E1"};
+	const unsigned int NVALUES=sizeof(values)/sizeof(values[0]);
+	const unsigned int NRARE=sizeof(rare)/sizeof(rare[0]);
+	const unsigned int NFORMULAS=sizeof(formulas)/sizeof(formulas[0]);
+	const string fname=tempFile();
+	Spreadsheet sheet;
+	unsigned int seed=7;
+	const auto edit=[&](){
+		const CellAddress addr(nextRandom(seed)%40,nextRandom(seed)%3);
+		const unsigned int r=nextRandom(seed);
+		sheet.changeCellValue(addr,r%16?values[r/16%NVALUES]:rare[r/16%NRARE]);
+	};
+	for(int i=0;i<60;i++)edit();
+	for(unsigned int i=0;i<NFORMULAS;i++)sheet.changeCellValue(CellAddress(i,4),formulas[i]);
+	for(int step=0;step<300;step++){
+		//single edits, and transactions with more changes than a cell keeps
+		if(step%3==0){
+			sheet.beginTransaction();
+			for(unsigned int n=nextRandom(seed)%40;n>0;n--)edit();
+			sheet.commitTransaction();
+		} else edit();
+		CHECK(sheet.saveToDisk(fname));
+		Spreadsheet loaded;
+		CHECK(loaded.loadFromDisk(fname));
+		for(unsigned int i=0;i<NFORMULAS;i++){
+			const CellAddress addr(i,4);
+			if(display(sheet,addr)!=display(loaded,addr)){
+				cerr<<"step "<<step<<": "<<formulas[i]<<" is "<<display(sheet,addr)
+				    <<", from scratch "<<display(loaded,addr)<<endl;
+				failures++;
+			}
+		}
+	}
+	unlink(fname.c_str());
+}
+
+static const string CIRCULAR="ERR:Circular reference chain";
+
+//whether the cell shows an error, either its own or one of its dependencies
+static bool isError(Spreadsheet &sheet,CellAddress addr){
+	return display(sheet,addr).find("ERR:")!=string::npos;
+}
+
+static bool isError(Spreadsheet &sheet,const string &repr){
+	return isError(sheet,cellAt(repr));
+}
+
+//the number a cell shows, or NaN if it doesn't show one
+static double number(Spreadsheet &sheet,CellAddress addr){
+	const string shown=display(sheet,addr);
+	char *end;
+	const double value=strtod(shown.c_str(),&end);
+	return shown.empty()||*end?NAN:value;
+}
+
+//SUM over long ranges gives the same results with and without a ColumnIndex,
+//while the number of ranges goes over the threshold for one and back again,
+//and with edits both while the column is indexed and while it isn't
+static void testColumnIndexThreshold(){
+	const unsigned int ROWS=4000,NRANGES=10;
+	Spreadsheet sheet;
+	vector<double> values(ROWS,0);
+	unsigned int seed=11;
+	const auto edit=[&](){
+		const unsigned int row=nextRandom(seed)%ROWS,r=nextRandom(seed)%8;
+		//integers, halves (which aren't exact integers), text and empty cells
+		string value;
+		if(r<4)value=to_string((int)(nextRandom(seed)%2000)-1000);
+		else if(r<5)value=to_string((int)(nextRandom(seed)%2000)-1000)+".5";
+		else if(r<6)value="text";
+		sheet.changeCellValue(CellAddress(row,1),value);
+		values[row]=r<6?strtod(value.c_str(),nullptr):0;
+	};
+	sheet.beginTransaction();
+	for(unsigned int i=0;i<3*ROWS;i++)edit();
+	sheet.commitTransaction();
+	//unaligned ranges of 512 rows and more, over partial and whole tiles
+	const auto rangeOf=[&](unsigned int i){
+		const unsigned int from=(NRANGES-1-i)*211+(i%3)*19;
+		return make_pair(from,from+511+i*97);
+	};
+	const auto setRange=[&](unsigned int i,bool present){
+		const auto range=rangeOf(i);
+		sheet.changeCellValue(CellAddress(i,3),present?
+			"=SUM(B"+to_string(range.first+1)+":B"+to_string(range.second+1)+")":"");
+	};
+	const auto check=[&](unsigned int nranges,const char *when){
+		for(unsigned int i=0;i<nranges;i++){
+			const auto range=rangeOf(i);
+			double expected=0;
+			for(unsigned int row=range.first;row<=range.second;row++)expected+=values[row];
+			const double got=number(sheet,CellAddress(i,3));
+			if(got!=expected){
+				cerr<<when<<" with "<<nranges<<" ranges: range "<<i<<" sums to "
+				    <<display(sheet,CellAddress(i,3))<<" instead of "<<expected<<endl;
+				failures++;
+			}
+		}
+	};
+	for(unsigned int n=1;n<=NRANGES;n++){
+		setRange(n-1,true);
+		check(n,"adding");
+	}
+	for(int i=0;i<100;i++){
+		edit();
+		check(NRANGES,"editing");
+	}
+	for(unsigned int n=NRANGES;n-->0;){
+		setRange(n,false);
+		check(n,"removing");
+		if(n==4){
+			for(int i=0;i<100;i++)edit();
+			check(n,"editing");
+		}
+	}
+	for(unsigned int n=1;n<=NRANGES;n++){
+		setRange(n-1,true);
+		check(n,"adding again");
+	}
+	//replacing a range by one of another size detaches the old one first
+	sheet.changeCellValue(CellAddress(0,3),"=SUM(B1:B100)");
+	double expected=0;
+	for(unsigned int row=0;row<100;row++)expected+=values[row];
+	CHECK(number(sheet,CellAddress(0,3))==expected);
+	for(int i=0;i<50;i++)edit();
+	for(unsigned int i=1;i<NRANGES;i++){
+		const auto range=rangeOf(i);
+		double sum=0;
+		for(unsigned int row=range.first;row<=range.second;row++)sum+=values[row];
+		CHECK(number(sheet,CellAddress(i,3))==sum);
+	}
+}
+
+//a cell that would close a cycle stays unattached with an error, until an
+//edit of a cell on the cycle breaks it
+static void testCycleBrokenInMiddle(){
+	for(calcmode_t mode : {CM_AUTOMATIC,CM_LAZY,CM_MANUAL}){
+		Spreadsheet sheet;
+		sheet.setCalcMode(mode);
+		setCell(sheet,"A1","=B1+1");
+		setCell(sheet,"B1","=C1+1");
+		setCell(sheet,"C1","=D1+1");
+		setCell(sheet,"D1","=A1+1");
+		setCell(sheet,"E1","=D1*2");
+		if(mode==CM_MANUAL)sheet.recalculateStale();
+		CHECK(display(sheet,"D1")==CIRCULAR);
+		CHECK(isError(sheet,"E1"));
+		//an edit off the cycle, or one that keeps it, leaves it alone
+		setCell(sheet,"F1","7");
+		setCell(sheet,"B1","=C1+2");
+		if(mode==CM_MANUAL)sheet.recalculateStale();
+		CHECK(display(sheet,"D1")==CIRCULAR);
+		setCell(sheet,"B1","10");
+		if(mode==CM_MANUAL)sheet.recalculateStale();
+		CHECK(display(sheet,"A1")=="11");
+		CHECK(display(sheet,"D1")=="12");
+		CHECK(display(sheet,"C1")=="13");
+		CHECK(display(sheet,"E1")=="24");
+		//the retried cell is attached again, so it follows its dependencies
+		setCell(sheet,"B1","20");
+		if(mode==CM_MANUAL)sheet.recalculateStale();
+		CHECK(display(sheet,"C1")=="23");
+		CHECK(display(sheet,"E1")=="44");
+	}
+}
+
+//a cycle closed through a range dependency is found like one through a cell
+static void testCycleThroughRange(){
+	Spreadsheet sheet;
+	setCell(sheet,"B1","1");
+	setCell(sheet,"B2","2");
+	setCell(sheet,"A1","=SUM(B1:B10)");
+	setCell(sheet,"C1","=A1*10");
+	CHECK(display(sheet,"C1")=="30");
+	setCell(sheet,"B5","=C1+1");
+	CHECK(display(sheet,"B5")==CIRCULAR);
+	CHECK(isError(sheet,"C1"));
+	setCell(sheet,"A1","=SUM(B1:B4)");
+	CHECK(display(sheet,"B5")=="31");
+	setCell(sheet,"B3","4");
+	CHECK(display(sheet,"B5")=="71");
+	//and a range that covers its own cell
+	setCell(sheet,"D1","=SUM(D1:D3)");
+	CHECK(display(sheet,"D1")=="ERR:Self-circular reference");
+}
+
+//levels, cycles and errors are handled without recursion, so a long chain
+//doesn't run out of stack
+static void testLongChain(){
+	const unsigned int length=100000;
+	Spreadsheet sheet;
+	sheet.changeCellValue(CellAddress(0,0),"1");
+	for(unsigned int row=1;row<length;row++){
+		sheet.changeCellValue(CellAddress(row,0),"=A"+to_string(row)+"+1");
+	}
+	CHECK(number(sheet,CellAddress(length-1,0))==length);
+	//raises the levels of the whole chain
+	sheet.changeCellValue(CellAddress(0,1),"5");
+	sheet.changeCellValue(CellAddress(0,0),"=B1*2");
+	CHECK(number(sheet,CellAddress(length-1,0))==length+9);
+	sheet.changeCellValue(CellAddress(0,1),"=A"+to_string(length));
+	CHECK(display(sheet,CellAddress(0,1))==CIRCULAR);
+	CHECK(isError(sheet,CellAddress(length-1,0)));
+	sheet.changeCellValue(CellAddress(0,0),"2");
+	CHECK(number(sheet,CellAddress(length-1,0))==length+1);
+	CHECK(number(sheet,CellAddress(0,1))==length+1);
+}
+
+//a chain of diamonds has exponentially many paths, but looking for a cycle
+//visits each cell once
+static void testDiamondChain(){
+	const unsigned int layers=200;
+	Spreadsheet sheet;
+	sheet.changeCellValue(CellAddress(0,0),"1");
+	sheet.changeCellValue(CellAddress(0,1),"1");
+	for(unsigned int row=1;row<layers;row++){
+		const string above=to_string(row);
+		sheet.changeCellValue(CellAddress(row,0),"=A"+above+"+B"+above);
+		sheet.changeCellValue(CellAddress(row,1),"=A"+above+"-B"+above);
+	}
+	double a=1,b=1;
+	for(unsigned int row=1;row<layers;row++){
+		const double nexta=a+b;
+		b=a-b;
+		a=nexta;
+	}
+	const string last=to_string(layers);
+	sheet.changeCellValue(CellAddress(0,2),"=A"+last);
+	CHECK(number(sheet,CellAddress(0,2))==a);
+	sheet.changeCellValue(CellAddress(0,0),"=C1");
+	CHECK(display(sheet,CellAddress(0,0))==CIRCULAR);
+	CHECK(isError(sheet,CellAddress(layers-1,1)));
+	//B1 reaches D1 by every path through the diamonds
+	sheet.changeCellValue(CellAddress(0,3),"=B"+last);
+	sheet.changeCellValue(CellAddress(0,1),"=D1");
+	CHECK(display(sheet,CellAddress(0,1))==CIRCULAR);
+	//with no cycle, the whole chain is attached and evaluated again
+	sheet.changeCellValue(CellAddress(0,0),"1");
+	sheet.changeCellValue(CellAddress(0,1),"1");
+	CHECK(number(sheet,CellAddress(0,2))==a);
+	CHECK(number(sheet,CellAddress(0,3))==b);
+}
+
+//closing a cycle in CM_LAZY or CM_MANUAL only evaluates the cells that get
+//its error, and the stale cells those depend on; other stale cells keep
+//waiting, and in the end all cells agree with CM_AUTOMATIC
+static void testCycleEvaluatesOnlyDependents(){
+	Spreadsheet automatic;
+	for(calcmode_t mode : {CM_AUTOMATIC,CM_LAZY,CM_MANUAL}){
+		Spreadsheet sheet;
+		sheet.setCalcMode(mode);
+		for(unsigned int row=0;row<2000;row++){
+			sheet.changeCellValue(CellAddress(row,0),to_string(row));
+			sheet.changeCellValue(CellAddress(row,1),"=A"+to_string(row+1)+"*2");
+		}
+		setCell(sheet,"C1","1");
+		setCell(sheet,"D1","=C1+E1");
+		setCell(sheet,"E1","=B1+B2");
+		if(mode==CM_MANUAL)sheet.recalculateStale();
+		setCell(sheet,"A1","100");
+		setCell(sheet,"A3","300");
+		setCell(sheet,"C1","=D1");
+		if(mode==CM_MANUAL){
+			//B3 doesn't depend on the cycle, so it isn't evaluated yet
+			CHECK(display(sheet,"B3")=="4");
+			//the cycle, and B1 which D1 depends on through E1, are
+			CHECK(display(sheet,"C1")==CIRCULAR);
+			CHECK(display(sheet,"B1")=="200");
+			sheet.recalculateStale();
+		}
+		CHECK(display(sheet,"B3")=="600");
+		CHECK(isError(sheet,"D1"));
+		CHECK(isError(sheet,"E1")==false);
+		setCell(sheet,"C1","5");
+		if(mode==CM_MANUAL)sheet.recalculateStale();
+		if(mode==CM_AUTOMATIC)automatic=move(sheet);
+		else for(const char *repr : {"B1","B3","C1","D1","E1"}){
+			CHECK(display(sheet,repr)==display(automatic,repr));
+		}
+	}
+	CHECK(display(automatic,"D1")=="207");
+}
+
+//parallelFor calls every index exactly once, also when called repeatedly
+static void testThreadPool(){
+	ThreadPool pool(4);
+	CHECK(pool.size()==4);
+	vector<atomic<unsigned int>> calls(10000);
+	for(unsigned int round=1;round<=50;round++){
+		pool.parallelFor(calls.size(),[&](size_t i){calls[i]++;});
+		unsigned int wrong=0;
+		for(const atomic<unsigned int> &n : calls)wrong+=n!=round;
+		CHECK(wrong==0);
+	}
+}
+
+//a wide sheet, whose waves of recalculation are evaluated in parallel,
+//gives the same values as one evaluated a cell at a time
+static void testParallelRecalculation(){
+	const unsigned int width=700; //cells per level, more than PARALLEL_THRESHOLD
+	const auto build=[&](Spreadsheet &sheet,unsigned int round){
+		for(unsigned int column=0;column<width;column++){
+			sheet.changeCellValue(CellAddress(0,column),to_string(column%13+round));
+		}
+		for(unsigned int column=0;column<width;column++){
+			const string name=columnLabel(column),next=columnLabel((column+1)%width);
+			sheet.changeCellValue(CellAddress(1,column),"="+name+"1*2-"+next+"1/3");
+			sheet.changeCellValue(CellAddress(2,column),"="+name+"2^2+"+next+"2%7");
+			sheet.changeCellValue(CellAddress(3,column),"=SUM("+name+"1:"+name+"3)+AVG("+next+"2:"+next+"3)");
+			sheet.changeCellValue(CellAddress(4,column),"=-"+name+"4+COUNT("+name+"1:"+next+"4)");
+		}
+	};
+	for(calcmode_t mode : {CM_AUTOMATIC,CM_LAZY,CM_MANUAL}){
+		Spreadsheet sheet;
+		sheet.setCalcMode(mode);
+		build(sheet,0);
+		if(mode==CM_MANUAL)sheet.recalculateStale();
+		//enough rounds for the formulas to be compiled to native code on the way
+		for(unsigned int round=1;round<=80;round++){
+			sheet.beginTransaction();
+			for(unsigned int column=0;column<width;column++){
+				sheet.changeCellValue(CellAddress(0,column),to_string(column%13+round));
+			}
+			sheet.commitTransaction();
+			if(mode==CM_MANUAL)sheet.recalculateStale();
+			if(round%20)continue;
+			//the formulas go in after the values, so each is evaluated on its own
+			Spreadsheet serial;
+			build(serial,round);
+			unsigned int wrong=0;
+			for(unsigned int row=1;row<5;row++){
+				for(unsigned int column=0;column<width;column++){
+					wrong+=display(sheet,CellAddress(row,column))!=display(serial,CellAddress(row,column));
+				}
+			}
+			CHECK(wrong==0);
+		}
+	}
+}
+
+//whether two sheets show the same in a cell; the message of an error depends
+//on whether a dependent was evaluated before or after its dependency got the
+//error, so of errors only compare that they are
+static bool sameDisplay(Spreadsheet &sheet1,Spreadsheet &sheet2,CellAddress addr){
+	if(isError(sheet1,addr)||isError(sheet2,addr)){
+		return isError(sheet1,addr)==isError(sheet2,addr);
+	}
+	return display(sheet1,addr)==display(sheet2,addr);
+}
+
+typedef vector<pair<string,string>> EditList; //cells and their new values
+
+//applies the edits one at a time, or all in one transaction, and brings the
+//sheet up to date
+static void applyEdits(Spreadsheet &sheet,const EditList &edits,bool transaction){
+	if(transaction)sheet.beginTransaction();
+	for(const auto &[repr,value] : edits)setCell(sheet,repr,value);
+	if(transaction){
+		CHECK(sheet.inTransaction());
+		sheet.commitTransaction();
+		CHECK(!sheet.inTransaction());
+	}
+	if(sheet.getCalcMode()==CM_MANUAL)sheet.recalculateStale();
+}
+
+//a transaction ends in the same state as making its edits one by one, in
+//every calculation mode
+static void testTransactions(){
+	const vector<EditList> cases={
+		//the same cell twice, and its dependencies after it
+		{{"A1","5"},{"B1","=A1+C1"},{"A1","=C1*2"},{"C1","3"},{"A1","=C1*3"}},
+		//a cycle that is made and broken again
+		{{"A1","=B1+1"},{"B1","=C1+1"},{"C1","=A1+1"},{"C1","4"}},
+		//and one that is made and left
+		{{"A1","=B1+1"},{"B1","=A1+1"},{"C1","=B1"}},
+		//the existing cycle of the last case broken, and values cleared
+		{{"B1","2"},{"D1","=SUM(A1:C1)"},{"C1",""},{"D1","=COUNT(A1:C1)"}},
+		//a cycle through a range, broken in its middle
+		{{"C1","=D1"},{"D1","=SUM(A1:C1)"},{"C1","1"}}
+	};
+	const vector<string> cells={"A1","B1","C1","D1","E1"};
+	for(calcmode_t mode : {CM_AUTOMATIC,CM_LAZY,CM_MANUAL}){
+		Spreadsheet single,batched;
+		single.setCalcMode(mode);
+		batched.setCalcMode(mode);
+		for(Spreadsheet *sheet : {&single,&batched}){
+			applyEdits(*sheet,{{"A1","1"},{"B1","=A1*2"},{"E1","=B1+D1"}},false);
+		}
+		for(const EditList &edits : cases){
+			applyEdits(single,edits,false);
+			applyEdits(batched,edits,true);
+			for(const string &repr : cells){
+				CHECK(sameDisplay(single,batched,cellAt(repr)));
+				CHECK(single.getCellEditString(cellAt(repr)).fromJust()==
+				      batched.getCellEditString(cellAt(repr)).fromJust());
+			}
+		}
+		CHECK(display(batched,"D1")=="6");
+		CHECK(display(batched,"E1")=="8");
+	}
+	//random edits that keep the sheet acyclic: which cell of a cycle gets the
+	//circular error depends on the history of edits, which a transaction
+	//collapses. Formulas only refer to cells before their own, in row-major
+	//order of A1:C2.
+	static const char *const constants[]={"","1","7","-2","0.5","text"};
+	unsigned int seed=3;
+	const auto randomEdit=[&](){
+		const unsigned int i=nextRandom(seed)%6;
+		const string repr=CellAddress(i/3,i%3).toRepresentation();
+		if(i==0||nextRandom(seed)%3==0)return make_pair(repr,string(constants[nextRandom(seed)%6]));
+		const unsigned int j=nextRandom(seed)%i,k=nextRandom(seed)%i;
+		const string a=CellAddress(j/3,j%3).toRepresentation(),b=CellAddress(k/3,k%3).toRepresentation();
+		switch(nextRandom(seed)%4){
+			case 0: return make_pair(repr,"="+a+"*2");
+			case 1: return make_pair(repr,"="+a+"+"+b);
+			case 2: return make_pair(repr,"=COUNT(A1:"+a+")+1");
+			default: return make_pair(repr,"=SUM(A1:"+a+")");
+		}
+	};
+	for(calcmode_t mode : {CM_AUTOMATIC,CM_LAZY,CM_MANUAL}){
+		Spreadsheet single,batched;
+		single.setCalcMode(mode);
+		batched.setCalcMode(mode);
+		for(int round=0;round<300;round++){
+			EditList edits;
+			for(unsigned int n=1+nextRandom(seed)%6;n>0;n--)edits.push_back(randomEdit());
+			applyEdits(single,edits,false);
+			applyEdits(batched,edits,true);
+			for(unsigned int i=0;i<6;i++){
+				CHECK(display(single,CellAddress(i/3,i%3))==display(batched,CellAddress(i/3,i%3)));
+			}
+		}
+	}
+}
+
+int main(){
+	//so that the parallel paths run with several threads even on one core
+	ThreadPool::setSharedSize(4);
+	testReadDoesNotAllocate();
+	testTallColumnTiles();
+	testManualEvaluatesEdits();
+	testSparseSaveLoad();
+	testDenseLoad();
+	testNativeMatchesInterpreter();
+	testNativeCodeReleased();
+	testAggregateDeltas();
+	testColumnIndexThreshold();
+	testCycleBrokenInMiddle();
+	testCycleThroughRange();
+	testLongChain();
+	testDiamondChain();
+	testCycleEvaluatesOnlyDependents();
+	testThreadPool();
+	testParallelRecalculation();
+	testTransactions();
+	testFormulaParsing();
+	testFilledFormulaShared();
+	testParseNumber();
+	testNumberFormat();
+	if(failures){
+		cerr<<failures<<" check(s) failed"<<endl;
+		return 1;
+	}
+	cout<<"All tests passed."<<endl;
+	return 0;
+}
@@ -0,0 +1,108 @@
+#include "threadpool.h"
+#include <algorithm>
+
+using namespace std;
+
+ThreadPool::ThreadPool(size_t nthreads){
+	nthreads=max(nthreads,(size_t)1);
+	for(size_t i=0;i<nthreads;i++)workers.emplace_back(new Worker);
+	for(size_t i=1;i<nthreads;i++){
+		threads.emplace_back(&ThreadPool::workerMain,this,i);
+	}
+}
+
+ThreadPool::~ThreadPool(){
+	{
+		lock_guard<mutex> guard(lock);
+		stopping=true;
+	}
+	wakeup.notify_all();
+	for(thread &t : threads)t.join();
+}
+
+size_t ThreadPool::size() const noexcept {
+	return workers.size();
+}
+
+bool ThreadPool::takeChunk(size_t self,Chunk &chunk){
+	{
+		Worker &own=*workers[self];
+		lock_guard<mutex> guard(own.lock);
+		if(own.chunks.size()){
+			chunk=own.chunks.back();
+			own.chunks.pop_back();
+			return true;
+		}
+	}
+	for(size_t i=1;i<workers.size();i++){
+		Worker &victim=*workers[(self+i)%workers.size()];
+		lock_guard<mutex> guard(victim.lock);
+		if(victim.chunks.size()){
+			chunk=victim.chunks.front();
+			victim.chunks.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::runChunks(size_t self){
+	Chunk chunk;
+	while(takeChunk(self,chunk)){
+		for(size_t i=chunk.begin;i<chunk.end;i++)(*chunk.f)(i);
+		lock_guard<mutex> guard(lock);
+		if(--chunksleft==0)finished.notify_all();
+	}
+}
+
+void ThreadPool::workerMain(size_t self){
+	size_t seen=0;
+	while(true){
+		{
+			unique_lock<mutex> guard(lock);
+			wakeup.wait(guard,[&]{return stopping||generation!=seen;});
+			if(stopping)return;
+			seen=generation;
+		}
+		runChunks(self);
+	}
+}
+
+void ThreadPool::parallelFor(size_t n,const function<void(size_t)> &f){
+	if(n==0)return;
+	if(workers.size()==1){
+		for(size_t i=0;i<n;i++)f(i);
+		return;
+	}
+	//a few chunks per worker, so that stealing can even out the load
+	const size_t nchunks=min(n,workers.size()*4);
+	{
+		//before dealing, since a worker still busy can take chunks right away
+		lock_guard<mutex> guard(lock);
+		chunksleft=nchunks;
+	}
+	for(size_t c=0;c<nchunks;c++){
+		Worker &w=*workers[c%workers.size()];
+		lock_guard<mutex> guard(w.lock);
+		w.chunks.push_back({n*c/nchunks,n*(c+1)/nchunks,&f});
+	}
+	{
+		lock_guard<mutex> guard(lock);
+		generation++;
+	}
+	wakeup.notify_all();
+	runChunks(0);
+	unique_lock<mutex> guard(lock);
+	finished.wait(guard,[&]{return chunksleft==0;});
+}
+
+static size_t sharedsize=0;
+
+ThreadPool& ThreadPool::shared(){
+	static ThreadPool pool(sharedsize?sharedsize:thread::hardware_concurrency());
+	return pool;
+}
+
+void ThreadPool::setSharedSize(size_t nthreads) noexcept {
+	sharedsize=nthreads;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <cstddef>
+
+using namespace std;
+
+/*
+A work-stealing thread pool for running independent jobs in parallel.
+parallelFor() cuts its index range into chunks that are dealt out over the
+deques of the workers; each worker takes chunks from the back of its own
+deque, and when that runs dry, steals from the front of the others. The
+calling thread joins in as one of the workers.
+*/
+
+class ThreadPool{
+	struct Chunk{
+		size_t begin,end;
+		const function<void(size_t)> *f;
+	};
+
+	struct Worker{
+		mutex lock;
+		deque<Chunk> chunks;
+	};
+
+	vector<unique_ptr<Worker>> workers; //workers[0] is the calling thread
+	vector<thread> threads;
+
+	mutex lock; //guards the fields below
+	condition_variable wakeup,finished;
+	size_t generation=0; //incremented for every parallelFor()
+	size_t chunksleft=0;
+	bool stopping=false;
+
+	bool takeChunk(size_t self,Chunk &chunk);
+	void runChunks(size_t self);
+	void workerMain(size_t self);
+
+public:
+	explicit ThreadPool(size_t nthreads);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&)=delete;
+	ThreadPool& operator=(const ThreadPool&)=delete;
+
+	size_t size() const noexcept; //number of threads, including the caller
+
+	//calls f(i) for all 0<=i<n, in parallel; returns when all calls are done.
+	//Not reentrant: f may not call parallelFor itself.
+	void parallelFor(size_t n,const function<void(size_t)> &f);
+
+	//pool with one thread per core, or as many as given to setSharedSize,
+	//created on first use
+	static ThreadPool& shared();
+	//sets the number of threads of shared(); only has effect before its first
+	//use, and 0 means one per core
+	static void setSharedSize(size_t nthreads) noexcept;
+};
@@ -51,7 +51,6 @@ void SheetView::redrawCell(CellAddress addr,bool dorefresh){
 	   addr.row>=scroll.row+LINES-1||addr.column>=scroll.column+COLS/8-1){
 		return;
 	}
-	sheet.ensureSheetSize(addr.column+1,addr.row+1);
 	int leftx;
 	string dispvalue,value;
 	dispvalue=sheet.getCellDisplayString(addr).fromJust();
@@ -63,8 +62,7 @@ void SheetView::redrawCell(CellAddress addr,bool dorefresh){
 		attron(A_REVERSE);
 		leftx=min(columnToX(addr.column),COLS/8*8-(int)value.size());
 	} else {
-		value=sheet.getCellDisplayString(addr).fromJust();
-		if(value.size()>8)value.erase(value.begin()+8,value.end());
+		value=sheet.getCellDisplayString(addr,8).fromJust();
 		leftx=columnToX(addr.column);
 	}
 	string blankstr(max(8,(int)value.size()),' ');
@@ -81,7 +79,6 @@ void SheetView::redrawCell(CellAddress addr,bool dorefresh){
 }
 
 void SheetView::setCursorPosition(CellAddress addr){
-	sheet.ensureSheetSize(addr.column+1,addr.row+1);
 	bool didscroll=false;
 	if(addr.column>=scroll.column+COLS/8-1){
 		scroll.column=addr.column-(COLS/8-1)+1;